@@ -34,6 +34,28 @@ bool validateRate(int rate) {
     return true;
 }
 
+void printSerialStats(const SerialStats& stats) {
+    printf("%-8s %4s %8s %6s %8s %8s %9s %9s %9s %9s\n", "Op", "Axis", "Count", "Fail", "Bytes tx", "Bytes rx",
+            "Queue p50", "1st p50", "RTT p50", "RTT p99");
+
+    for (int op = 0; op < SERIAL_OP_COUNT; op++) {
+        for (int axis = 0; axis < 2; axis++) {
+            const SerialOpStats &opStats = stats.m_ops[op][axis];
+            if (opStats.count() == 0) continue;
+
+            printf("%-8s %4d %8llu %6llu %8llu %8llu %9llu %9llu %9llu %9llu\n", serialOpNames[op], axis,
+                    (unsigned long long) opStats.count(), (unsigned long long) opStats.failures(),
+                    (unsigned long long) opStats.bytesWritten(), (unsigned long long) opStats.bytesRead(),
+                    (unsigned long long) opStats.m_queueWait.percentile(50),
+                    (unsigned long long) opStats.m_firstByte.percentile(50),
+                    (unsigned long long) opStats.m_roundTrip.percentile(50),
+                    (unsigned long long) opStats.m_roundTrip.percentile(99));
+        }
+    }
+
+    puts("Times in microseconds");
+}
+
 bool measureSlewRate(Brexos2Direct& mount, unsigned axis) {
     int initialCount;
     int prevCount;
@@ -63,8 +85,9 @@ bool measureSlewRate(Brexos2Direct& mount, unsigned axis) {
 int main(int argc, char **argv) {
     Brexos2Direct mount;
     int exitCode = 1;
+    const char *devicePath = argc > 1 ? argv[1] : "/dev/ttyUSB0";
 
-    if (!mount.init("/dev/ttyUSB0")) {
+    if (!mount.init(devicePath)) {
         puts("Cannot connect to mount");
         return exitCode;
     }
@@ -106,6 +129,9 @@ int main(int argc, char **argv) {
         else if (strcmp(cmd, "print_axes") == 0) {
             mount.printAxes();
         }
+        else if (strcmp(cmd, "stats") == 0) {
+            printSerialStats(mount.getSerialStats());
+        }
         else if (strcmp(cmd, "slew") == 0) {
             if (validateAxis(axis) && validateRate(param1)) {
                 result = mount.slew(axis, param1);
@@ -117,8 +143,8 @@ int main(int argc, char **argv) {
             }
         }
         else if (strcmp(cmd, "goto") == 0) {
-            if (validateAxis(axis) && validateRate(param1)) {
-                result = mount.goTo(axis, param1, param2);
+            if (validateAxis(axis)) {
+                result = mount.goTo(axis, param1);
             }
         }
         else if (strcmp(cmd, "cmd10") == 0) {
@@ -0,0 +1 @@
+../../brexos2pmc8/src/recorder.cpp
\ No newline at end of file
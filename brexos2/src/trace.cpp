@@ -0,0 +1 @@
+../../brexos2pmc8/src/trace.cpp
\ No newline at end of file
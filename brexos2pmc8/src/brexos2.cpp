@@ -1,31 +1,164 @@
 #pragma once
 #include <cstdio>
 #include <ctime>
-#include <termios.h>
-#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
 #include <math.h>
+#include <sys/eventfd.h>
 #include "fd.cpp"
 #include "debug.cpp"
-
-#define BREXOS2_AXIS_INDEX_RA 0
-#define BREXOS2_AXIS_INDEX_DEC 1
-
-#define BREXOS2_AXIS_STATUS_SLEWING    0x04
-#define BREXOS2_AXIS_STATUS_DISABLED   0x08
-#define BREXOS2_AXIS_STATUS_DIRECTION  0x80
+#include "clock.cpp"
+#include "seqlock.cpp"
+#include "serial.cpp"
+#include "histogram.cpp"
+#include "estimator.cpp"
+#include "mpscqueue.cpp"
+#include "trajectory.cpp"
+#include "trace.cpp"
+#include "state.cpp"
+#include "protocol.cpp"
 
 #define BREXOS2_MIN_GOTO_RATE 20
 #define BREXOS2_MAX_GOTO_RATE 4000
+#define BREXOS2_DEFAULT_GOTO_ACCELERATION 2000  // Rate units per second
+#define BREXOS2_DEFAULT_GOTO_JERK 4000          // Rate units per second squared
 
 #define BREXOS2_MAX_GUIDING_PULSE_RATE 5
+#define BREXOS2_GUIDE_STATUS_MAX_AGE_MS 500 // Guide pulses skip the inquiry if the status is this recent
 
 #define BREXOS2_SLEW_RAMP_THRESHOLD_RATE 1600
 #define BREXOS2_MAX_SLEW_RATE BREXOS2_MAX_GOTO_RATE
 #define BREXOS2_SLEW_RAMP_STEP 200
 
+#define BREXOS2_BACKLASH_TAKEUP_MS 100
+
+// Repeated slew/goto frames are dropped, but resent this often in case the controller missed one
+#define BREXOS2_COMMAND_REFRESH_MS 2000
+#define BREXOS2_GOTO_RATE_HYSTERESIS_PERCENT 5
+
+// Counts per second for one unit of slew/goto rate, sidereal rate 5 is ~38 counts/s
+#define BREXOS2_COUNTS_PER_SEC_PER_RATE (38.0 / 5.0)
+#define BREXOS2_MAX_EXTRAPOLATION_MS 1000
+
+// Manager polls each axis only as often as its current activity needs
+#define BREXOS2_POLL_FAST_MS 25        // Slew ramp, goto final approach
+#define BREXOS2_POLL_NORMAL_MS 100     // Goto, slewing, guiding
+#define BREXOS2_POLL_TRACKING_MS 250   // Steady tracking, positions come from the estimator
+#define BREXOS2_POLL_IDLE_MS 500       // Enabled but not moving
+#define BREXOS2_POLL_DISABLED_MS 1000  // Motors disabled
+#define BREXOS2_GOTO_APPROACH_DISTANCE 20000
+#define BREXOS2_POWER_SAVE_DELAY_MS 10000
+
+#define BREXOS2_MAILBOX_SIZE 64
+#define BREXOS2_MOTION_BATCH_SIZE 4 // Motion frames of one manager tick written together
+
+/* Axis state as last sampled by the manager thread */
+struct Brexos2AxisState {
+    int64_t m_sampleTime; // CLOCK_MONOTONIC ns, 0 if never sampled
+    int m_position;
+    int m_rate;
+    uint32_t m_status;
+    int m_gotoTarget;
+    int m_trackingRate;
+    int64_t m_estimateTime;
+    double m_estimatePosition;
+    double m_estimateVelocity; // Counts per second
+    double m_estimateResidual; // Counts, last sample minus prediction
+};
+
+/* Manager thread timing, updated with relaxed atomics */
+struct Brexos2Metrics {
+    uint64_t m_ticks;
+    uint64_t m_commands;
+    uint64_t m_mailboxFull;
+    uint64_t m_suppressedFrames;
+    uint64_t m_guideFastPaths;  // Guide pulses sent without an inquiry first
+    uint64_t m_asyncFailures;   // Posted commands nobody waited for that failed
+    Histogram m_tickDuration;
+    Histogram m_tickJitter;   // Wakeup past the scheduled deadline
+    Histogram m_commandWait;  // Command posted until the manager picked it up
+
+    Brexos2Metrics(): m_ticks(0), m_commands(0), m_mailboxFull(0), m_suppressedFrames(0), m_guideFastPaths(0),
+            m_asyncFailures(0) {
+    }
+
+    uint64_t ticks() const {
+        return __atomic_load_n(&m_ticks, __ATOMIC_RELAXED);
+    }
+
+    uint64_t commands() const {
+        return __atomic_load_n(&m_commands, __ATOMIC_RELAXED);
+    }
+
+    uint64_t mailboxFull() const {
+        return __atomic_load_n(&m_mailboxFull, __ATOMIC_RELAXED);
+    }
+
+    uint64_t suppressedFrames() const {
+        return __atomic_load_n(&m_suppressedFrames, __ATOMIC_RELAXED);
+    }
+
+    uint64_t guideFastPaths() const {
+        return __atomic_load_n(&m_guideFastPaths, __ATOMIC_RELAXED);
+    }
+
+    uint64_t asyncFailures() const {
+        return __atomic_load_n(&m_asyncFailures, __ATOMIC_RELAXED);
+    }
+};
+
+enum Brexos2CommandType {
+    BREXOS2_CMD_ENABLE,
+    BREXOS2_CMD_TRACK,
+    BREXOS2_CMD_SLEW,
+    BREXOS2_CMD_GOTO,
+    BREXOS2_CMD_GOTO_SYNC,
+    BREXOS2_CMD_INQUIRY,
+    BREXOS2_CMD_0F,
+    BREXOS2_CMD_10,
+    BREXOS2_CMD_PRINT
+};
+
+/* Completion token, signalled by the manager thread once it has run the command */
+struct Brexos2Completion {
+    sem_t m_done;
+    bool m_result;
+    uint8_t m_status;
+    int m_value; // Inquiry count or command 0x10 value
+
+    Brexos2Completion(): m_result(false), m_status(0), m_value(0) {
+        sem_init(&m_done, 0, 0);
+    }
+
+    ~Brexos2Completion() {
+        sem_destroy(&m_done);
+    }
+
+    void signal(bool result) {
+        m_result = result;
+        sem_post(&m_done);
+    }
+
+    bool wait() {
+        while (sem_wait(&m_done) == -1 && errno == EINTR);
+        return m_result;
+    }
+};
+
+/* Frontend request to the manager thread */
+struct Brexos2Command {
+    uint8_t m_type;
+    uint8_t m_axisIndex;
+    int m_rate;
+    int m_param;  // Goto target, command 0x0F parameter or enable flag
+    int m_param2; // DEC target of a synchronized goto
+    int64_t m_submitTime;
+    Brexos2Completion *m_completion;
+};
+
 class Brexos2Direct {
     struct Axis {
         int m_rate;
@@ -35,14 +168,28 @@ class Brexos2Direct {
         int m_currentTrackingRate;
         int m_position;
         uint8_t m_status;
+        bool m_statusStale;         // Goto or enable frame sent since the status was sampled
         int m_gotoStart;
         int m_gotoTarget;
         int m_gotoRate;
+        bool m_gotoDeferred;        // Asked for while the serial device was lost, started once it is back
+        int64_t m_gotoStartTime;
+        GotoTrajectory m_gotoTrajectory;
         int m_backlashComp;
+        int64_t m_backlashDeadline; // Take-up slew in progress until then, 0 if none
+        int m_backlashPendingRate;  // Sent once the take-up is done
+        int64_t m_sampleTime;
+        int64_t m_nextPoll;
+        uint8_t m_lastCommand[SERIAL_MAX_FRAME_LEN]; // Last slew or goto frame sent
+        int m_lastCommandLen;
+        int64_t m_lastCommandTime;
+        PositionEstimator m_estimator;
 
         Axis(): m_rate(0), m_slewRate(0), m_slewRampActive(false), m_trackingRate(0), m_currentTrackingRate(0),
-                m_position(0), m_status(BREXOS2_AXIS_STATUS_DISABLED), m_gotoStart(0), m_gotoTarget(0), m_gotoRate(0),
-                m_backlashComp(0) {
+                m_position(0), m_status(BREXOS2_AXIS_STATUS_DISABLED), m_statusStale(true), m_gotoStart(0),
+                m_gotoTarget(0), m_gotoRate(0), m_gotoDeferred(false), m_gotoStartTime(0),
+                m_backlashComp(0), m_backlashDeadline(0), m_backlashPendingRate(0), m_sampleTime(0), m_nextPoll(0),
+                m_lastCommandLen(0), m_lastCommandTime(0) {
         }
 
         void print(uint8_t index) {
@@ -78,56 +225,140 @@ class Brexos2Direct {
         uint8_t getDirection() {
             return m_status & BREXOS2_AXIS_STATUS_DIRECTION ? 0 : 1;
         }
+
+        bool isGotoActive() const {
+            return !(m_status & BREXOS2_AXIS_STATUS_SLEWING) && m_gotoTarget != m_gotoStart;
+        }
+
+        /*
+         * A guide pulse only changes the rate of an axis that is already slewing or tracking, so a recent status is
+         * enough to build its frame. The manager samples a tracking axis every BREXOS2_POLL_TRACKING_MS.
+         */
+        bool canGuideFromCache(int rate, int64_t now) const {
+            uint8_t mode = m_status & (BREXOS2_AXIS_STATUS_DISABLED | BREXOS2_AXIS_STATUS_SLEWING);
+
+            return rate > -BREXOS2_MAX_GUIDING_PULSE_RATE && rate < BREXOS2_MAX_GUIDING_PULSE_RATE
+                    && !m_statusStale && !m_slewRampActive && mode == BREXOS2_AXIS_STATUS_SLEWING
+                    && now - m_sampleTime < BREXOS2_GUIDE_STATUS_MAX_AGE_MS * NS_PER_MS;
+        }
+
+        int64_t getPollInterval(int64_t now) const {
+            if (m_status & BREXOS2_AXIS_STATUS_DISABLED) return BREXOS2_POLL_DISABLED_MS * NS_PER_MS;
+            if (m_slewRampActive) return BREXOS2_POLL_FAST_MS * NS_PER_MS;
+
+            if (isGotoActive()) {
+                // Follow the profile closely while it ramps up and down
+                int remaining = abs(m_gotoTarget - m_position);
+                bool ramping = (now - m_gotoStartTime) * 1e-9 < m_gotoTrajectory.rampTime()
+                        || remaining < m_gotoTrajectory.stoppingDistance()
+                        || remaining < BREXOS2_GOTO_APPROACH_DISTANCE;
+                return (ramping ? BREXOS2_POLL_FAST_MS : BREXOS2_POLL_NORMAL_MS) * NS_PER_MS;
+            }
+
+            if (m_slewRate == 0 && m_trackingRate != 0) return BREXOS2_POLL_TRACKING_MS * NS_PER_MS;
+            if (m_rate != 0 || m_trackingRate != 0) return BREXOS2_POLL_NORMAL_MS * NS_PER_MS;
+            return BREXOS2_POLL_IDLE_MS * NS_PER_MS;
+        }
+
+        /* Counts per second the controller was last told to move at */
+        double getCommandedVelocity() const {
+            if (m_status & BREXOS2_AXIS_STATUS_DISABLED) return 0;
+            if (m_status & BREXOS2_AXIS_STATUS_SLEWING) return m_rate * BREXOS2_COUNTS_PER_SEC_PER_RATE;
+            if (m_gotoTarget == m_position) return 0;
+
+            double velocity = m_gotoRate * BREXOS2_COUNTS_PER_SEC_PER_RATE;
+            return m_gotoTarget > m_position ? velocity : -velocity;
+        }
+
+        /* Rate a slewing axis was last asked for, guide pulses add to tracking */
+        int getRequestedRate() const {
+            if (m_trackingRate == 0 || m_slewRate <= -BREXOS2_MAX_GUIDING_PULSE_RATE
+                    || m_slewRate >= BREXOS2_MAX_GUIDING_PULSE_RATE) {
+                return m_slewRate;
+            }
+
+            int rate = m_currentTrackingRate + m_slewRate;
+            return rate > 0 ? rate : 0;
+        }
+
+        int getReportedRate() const {
+            if (m_gotoDeferred) return BREXOS2_MIN_GOTO_RATE * 25; // Runs once the serial device is back
+            if (m_status & BREXOS2_AXIS_STATUS_DISABLED) return 0;
+            return (m_status & BREXOS2_AXIS_STATUS_SLEWING) ? m_slewRate : m_gotoRate * 25;
+        }
     };
 
-    FileDescriptor m_fd;
+    SerialLink m_link;
     pthread_t m_managerThread;
-    pthread_mutex_t m_managerMutex;
     int m_managerThreadCreateStatus;
-    int m_managerMutexCreateStatus;
-    Axis m_axes[2];
-    int m_axesIdleCount;
+    FileDescriptor m_wakeFd;
+    MpscQueue<Brexos2Command, BREXOS2_MAILBOX_SIZE> m_mailbox;
+    Axis m_axes[2];  // Owned by the manager thread once it runs
+    TrajectoryLimits m_gotoLimits;
+    SeqLock<Brexos2AxisState> m_axisStates[2];
+    int m_pendingGotos[2];  // Posted gotos the manager hasn't run yet
+    SerialTransaction m_motionBatch[BREXOS2_MOTION_BATCH_SIZE]; // Manager thread only
+    int m_numMotionBatched;
+    bool m_batchMotion;     // Motion frames wait for flushMotion() instead of being written right away
+    int64_t m_idleSince;
     int m_tickCount;
+    uint64_t m_restoredReconnects; // Serial device reopenings the axes have been restored after
+    bool m_stopRequested;
+    SessionState *m_state;  // Tracking rates outlive the process in it, NULL if not kept
+    Brexos2Metrics m_metrics;
  public:
-    Brexos2Direct(): m_managerThreadCreateStatus(-1), m_managerMutexCreateStatus(-1), m_axesIdleCount(0), m_tickCount(0) {
-        m_axes[1].m_backlashComp = 120; // Speed 120 (24xsidereal) for 100ms
+    Brexos2Direct(): m_managerThreadCreateStatus(-1),
+            m_gotoLimits(BREXOS2_MAX_GOTO_RATE, BREXOS2_DEFAULT_GOTO_ACCELERATION, BREXOS2_DEFAULT_GOTO_JERK),
+            m_numMotionBatched(0), m_batchMotion(false), m_idleSince(0), m_tickCount(0),
+            m_restoredReconnects(0), m_stopRequested(false), m_state(NULL) {
+        m_pendingGotos[0] = 0;
+        m_pendingGotos[1] = 0;
+        m_axes[1].m_backlashComp = 120; // Speed 120 (24xsidereal) for BREXOS2_BACKLASH_TAKEUP_MS
     }
 
     ~Brexos2Direct() {
         if (m_managerThreadCreateStatus == 0) {
-            pthread_cancel(m_managerThread);
+            // Not cancelled, so that it never leaves a queued serial transaction behind
+            __atomic_store_n(&m_stopRequested, true, __ATOMIC_RELEASE);
+            wakeManager();
             pthread_join(m_managerThread, NULL);
         }
 
-        if (m_managerMutexCreateStatus == 0) {
-            pthread_mutex_destroy(&m_managerMutex);
-        }
+        failCommands();
     }
 
     bool init(const char *devPath) {
-        int dev = open(devPath, O_RDWR | O_NOCTTY);
-        if (dev == -1) return false;
-        m_fd.set(dev);
+        m_link.setReconnectCallback(linkReconnected, this);
+        if (!m_link.open(devPath)) return false;
+
+        if (m_wakeFd == -1) {
+            // Frontends post to the mailbox and wake the manager through this
+            int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeFd == -1) goto err;
+            m_wakeFd.set(wakeFd);
+        }
 
-        termios params;
-        if (tcgetattr(dev, &params) == -1) goto err;
+        {
+            // Cold start stops whatever the mount was doing, a warm one carries on tracking
+            bool warmStart = isWarmStart();
+            if (!warmStart && !cmdEnableMotors(false)) goto err;
+            if (!updateAxis(0)) goto err;
+            if (!updateAxis(1)) goto err;
 
-        cfmakeraw(&params);
-        cfsetispeed(&params, B9600);
-        cfsetospeed(&params, B9600);
-        params.c_cflag = CS8 | CREAD | CLOCAL;
-        params.c_cc[VTIME] = 5;
-        params.c_cc[VMIN] = 0;
-        if (tcsetattr(dev, TCSANOW, &params) == -1) goto err;
+            for (uint8_t axisIndex = 0; warmStart && axisIndex < 2; axisIndex++) {
+                int rate = m_state->trackingRate(axisIndex);
+                dprintf("Warm start: axis=%u, tracking rate=%d\n", axisIndex, rate);
 
-        if (m_managerMutexCreateStatus != 0) {
-            m_managerMutexCreateStatus = pthread_mutex_init(&m_managerMutex, NULL);
-            if (m_managerMutexCreateStatus != 0) goto err;
+                if (rate != 0) {
+                    runTrack(axisIndex, rate);
+                } else {
+                    runSlew(axisIndex, 0);
+                }
+            }
         }
 
-        if (!cmdEnableMotors(false)) goto err;
-        if (!updateAxis(0)) goto err;
-        if (!updateAxis(1)) goto err;
+        publishAxis(0);
+        publishAxis(1);
 
         #ifdef DEBUG
             m_axes[0].print(0);
@@ -140,30 +371,445 @@ class Brexos2Direct {
             return true;
         }
     err:
-        m_fd.close();
+        m_link.close();
         return false;
     }
 
+    /* Call before init */
+    void setGotoLimits(int maxRate, int acceleration, int jerk) {
+        if (maxRate < BREXOS2_MIN_GOTO_RATE) maxRate = BREXOS2_MIN_GOTO_RATE;
+        if (maxRate > BREXOS2_MAX_GOTO_RATE) maxRate = BREXOS2_MAX_GOTO_RATE;
+
+        m_gotoLimits.m_maxRate = maxRate;
+        if (acceleration > 0) m_gotoLimits.m_acceleration = acceleration;
+        if (jerk > 0) m_gotoLimits.m_jerk = jerk;
+    }
+
+    /* Call before init */
+    void setRecorder(SerialRecorder *recorder) {
+        m_link.setRecorder(recorder);
+    }
+
+    /* Call before init, the mount keeps tracking across a restart if it was */
+    void setState(SessionState *state) {
+        m_state = state;
+    }
+
+    void setMaxInFlight(int maxInFlight) {
+        m_link.setMaxInFlight(maxInFlight);
+    }
+
+    const SerialStats& getSerialStats() const {
+        return m_link.getStats();
+    }
+
+    const Brexos2Metrics& getMetrics() const {
+        return m_metrics;
+    }
+
+    /* Commands below run on the manager thread, callers only wait for their completion token */
     bool enableMotors(bool enable) {
-        bool result = false;
+        return execute(BREXOS2_CMD_ENABLE, 0, 0, enable);
+    }
+
+    bool track(uint8_t axisIndex, int rate) {
+        return execute(BREXOS2_CMD_TRACK, axisIndex, rate);
+    }
+
+    bool slew(uint8_t axisIndex, int rate) {
+        return execute(BREXOS2_CMD_SLEW, axisIndex, rate);
+    }
+
+    bool inquiry(uint8_t axisIndex, uint8_t& status, int& count) {
+        Brexos2Completion completion;
+        if (!postCommand(BREXOS2_CMD_INQUIRY, axisIndex, 0, 0, &completion) || !completion.wait()) return false;
+
+        status = completion.m_status;
+        count = completion.m_value;
+        return true;
+    }
+
+    /* Rates follow the goto profile, see setGotoLimits */
+    bool goTo(uint8_t axisIndex, int target) {
+        return execute(BREXOS2_CMD_GOTO, axisIndex, 0, target);
+    }
+
+    /* Moves both axes so that they arrive at the same time */
+    bool goToSync(int raTarget, int decTarget) {
+        return execute(BREXOS2_CMD_GOTO_SYNC, 0, 0, raTarget, decTarget);
+    }
 
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            result = cmdEnableMotors(enable);
-            pthread_mutex_unlock(&m_managerMutex);
+    /*
+     * Like goTo, but returns once the manager has the goto queued. A goto that fails in the manager is only logged
+     * and counted in the async failures, the caller learns of it from the axis rate dropping to 0 like after an
+     * ordinary goto that finished.
+     */
+    bool postGoTo(uint8_t axisIndex, int target) {
+        if (axisIndex > 1) return false;
+
+        __atomic_fetch_add(&m_pendingGotos[axisIndex], 1, __ATOMIC_RELEASE);
+        if (postCommand(BREXOS2_CMD_GOTO, axisIndex, 0, target, NULL)) return true;
+
+        __atomic_fetch_sub(&m_pendingGotos[axisIndex], 1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    bool postGoToSync(int raTarget, int decTarget) {
+        __atomic_fetch_add(&m_pendingGotos[0], 1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&m_pendingGotos[1], 1, __ATOMIC_RELEASE);
+        if (postCommand(BREXOS2_CMD_GOTO_SYNC, 0, 0, raTarget, NULL, decTarget)) return true;
+
+        __atomic_fetch_sub(&m_pendingGotos[0], 1, __ATOMIC_RELEASE);
+        __atomic_fetch_sub(&m_pendingGotos[1], 1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    /* Like slew and track, but return once the manager has the command queued. Failures are only logged. */
+    bool postSlew(uint8_t axisIndex, int rate) {
+        return axisIndex <= 1 && postCommand(BREXOS2_CMD_SLEW, axisIndex, rate, 0, NULL);
+    }
+
+    bool postTrack(uint8_t axisIndex, int rate) {
+        return axisIndex <= 1 && postCommand(BREXOS2_CMD_TRACK, axisIndex, rate, 0, NULL);
+    }
+
+    /* Lock-free, returns the state published by the manager thread without any serial I/O */
+    bool getAxisState(uint8_t axisIndex, Brexos2AxisState& state) const {
+        m_axisStates[axisIndex].load(state);
+        return state.m_sampleTime != 0;
+    }
+
+    /* Changes whenever a new state is published */
+    uint32_t getAxisStateSequence(uint8_t axisIndex) const {
+        return m_axisStates[axisIndex].sequence();
+    }
+
+    /* Lock-free, extrapolates the published estimate to now */
+    bool getAxisPosition(uint8_t axisIndex, int& position) const {
+        Brexos2AxisState state;
+        if (!getAxisState(axisIndex, state)) return false;
+
+        int64_t elapsed = monotonicNs() - state.m_estimateTime;
+        if (elapsed < 0) elapsed = 0;
+        if (elapsed > BREXOS2_MAX_EXTRAPOLATION_MS * NS_PER_MS) elapsed = BREXOS2_MAX_EXTRAPOLATION_MS * NS_PER_MS;
+
+        double estimate = state.m_estimatePosition + state.m_estimateVelocity * elapsed * 1e-9;
+
+        // Controller stops a goto at the target, so never predict past it
+        if (!(state.m_status & (BREXOS2_AXIS_STATUS_SLEWING | BREXOS2_AXIS_STATUS_DISABLED))) {
+            if (state.m_estimateVelocity > 0 && estimate > state.m_gotoTarget) estimate = state.m_gotoTarget;
+            if (state.m_estimateVelocity < 0 && estimate < state.m_gotoTarget) estimate = state.m_gotoTarget;
         }
 
+        position = lround(estimate);
+        return true;
+    }
+
+    /*
+     * A posted goto counts as moving until the manager has run it. From then on the published state shows the goto
+     * until an inquiry reports it finished, or shows the axis as it was if the goto failed.
+     */
+    bool getAxisRate(uint8_t axisIndex, int& rate) const {
+        Brexos2AxisState state;
+        if (!getAxisState(axisIndex, state)) return false;
+
+        rate = __atomic_load_n(&m_pendingGotos[axisIndex], __ATOMIC_ACQUIRE) != 0
+                ? BREXOS2_MIN_GOTO_RATE * 25 : state.m_rate;
+        return true;
+    }
+
+    bool cmd0f(uint8_t axisIndex, unsigned param) {
+        return execute(BREXOS2_CMD_0F, axisIndex, 0, param);
+    }
+
+    bool cmd10(uint8_t axisIndex, unsigned &retval) {
+        Brexos2Completion completion;
+        if (!postCommand(BREXOS2_CMD_10, axisIndex, 0, 0, &completion) || !completion.wait()) return false;
+
+        retval = completion.m_value;
+        return true;
+    }
+
+    void printAxes() {
+        execute(BREXOS2_CMD_PRINT, 0);
+    }
+private:
+    /* Posts a command to the manager thread and waits for its completion */
+    bool execute(uint8_t type, uint8_t axisIndex, int rate = 0, int param = 0, int param2 = 0) {
+        Brexos2Completion completion;
+        return postCommand(type, axisIndex, rate, param, &completion, param2) && completion.wait();
+    }
+
+    bool postCommand(uint8_t type, uint8_t axisIndex, int rate, int param, Brexos2Completion *completion,
+            int param2 = 0) {
+        if (m_managerThreadCreateStatus != 0 || __atomic_load_n(&m_stopRequested, __ATOMIC_ACQUIRE)) return false;
+
+        Brexos2Command command = { type, axisIndex, rate, param, param2, monotonicNs(), completion };
+
+        if (!m_mailbox.push(command)) {
+            __atomic_fetch_add(&m_metrics.m_mailboxFull, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        wakeManager();
+        return true;
+    }
+
+    void wakeManager() {
+        uint64_t one = 1;
+        m_wakeFd.writeFully(&one, sizeof(one));
+    }
+
+    bool isWarmStart() {
+        if (m_state == NULL || !m_state->isRestored()) return false;
+        return m_state->trackingRate(0) != 0 || m_state->trackingRate(1) != 0;
+    }
+
+    static void linkReconnected(void *context) {
+        ((Brexos2Direct *) context)->wakeManager();
+    }
+
+    static void *managerThreadProc(void *arg) {
+        ((Brexos2Direct *) arg)->manageMount();
+        return NULL;
+    }
+
+    void manageMount() {
+        traceThreadName("manager");
+        int64_t deadline = monotonicNs();
+        pollfd pfd = { m_wakeFd, POLLIN, 0 };
+
+        while (!__atomic_load_n(&m_stopRequested, __ATOMIC_ACQUIRE)) {
+            int64_t timeout = deadline - monotonicNs();
+            int pollResult = 0;
+
+            if (timeout > 0) {
+                timespec timeoutSpec = { (time_t) (timeout / NS_PER_SEC), (long) (timeout % NS_PER_SEC) };
+                pollResult = ppoll(&pfd, 1, &timeoutSpec, NULL);
+            }
+
+            if (pollResult > 0) {
+                uint64_t count;
+                m_wakeFd.read(&count, sizeof(count));
+            }
+
+            int64_t tickStart = monotonicNs();
+            traceBegin(TRACE_TICK);
+
+            if (pollResult == 0) {
+                m_metrics.m_tickJitter.recordNs(tickStart - deadline);
+            }
+
+            if (m_link.getStats().reconnects() != m_restoredReconnects) restoreMotion();
+            runCommands();
+
+            // One write for the inquiries of all due axes, then one for the motion frames they lead to
+            bool due[2] = { tickStart >= m_axes[0].m_nextPoll, tickStart >= m_axes[1].m_nextPoll };
+            bool sampled[2];
+            updateAxes(due, sampled);
+            m_batchMotion = true;
+
+            for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+                Axis &axis = m_axes[axisIndex];
+                if (!due[axisIndex]) continue;
+
+                if (sampled[axisIndex]) manageAxis(axisIndex, tickStart);
+                axis.m_nextPoll = tickStart + axis.getPollInterval(tickStart);
+
+                if (axis.m_backlashDeadline != 0 && axis.m_backlashDeadline < axis.m_nextPoll) {
+                    axis.m_nextPoll = axis.m_backlashDeadline;
+                }
+            }
+
+            m_batchMotion = false;
+            flushMotion();
+
+            for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+                if (due[axisIndex]) publishAxis(axisIndex);
+            }
+
+            managePowerSave(tickStart);
+            m_tickCount++;
+
+            deadline = m_axes[0].m_nextPoll < m_axes[1].m_nextPoll ? m_axes[0].m_nextPoll : m_axes[1].m_nextPoll;
+            m_metrics.m_tickDuration.recordNs(monotonicNs() - tickStart);
+            __atomic_fetch_add(&m_metrics.m_ticks, 1, __ATOMIC_RELAXED);
+            traceEnd(TRACE_TICK);
+        }
+
+        failCommands();
+    }
+
+    /*
+     * Serial device was reopened. The controllers missed whatever was sent meanwhile, or lost all their state if
+     * the mount lost power too, so each axis is brought back to the tracking rate, slew or goto last asked for.
+     */
+    void restoreMotion() {
+        m_restoredReconnects = m_link.getStats().reconnects();
+
+        bool wasGoto[2];
+        bool wasMoving[2];
+
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            Axis &axis = m_axes[axisIndex];
+            wasGoto[axisIndex] = axis.m_gotoDeferred || (axis.isGotoActive() && axis.m_position != axis.m_gotoTarget);
+            wasMoving[axisIndex] = wasGoto[axisIndex] || axis.getRequestedRate() != 0 || axis.m_trackingRate != 0;
+            axis.m_backlashDeadline = 0;
+            axis.m_lastCommandLen = 0; // Resend even if identical
+        }
+
+        const bool all[2] = { true, true };
+        bool sampled[2];
+        updateAxes(all, sampled);
+
+        bool enable = false;
+
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            Axis &axis = m_axes[axisIndex];
+            if (!sampled[axisIndex] || !(axis.m_status & BREXOS2_AXIS_STATUS_DISABLED)) continue;
+
+            // Controller was reset, it's not moving at any rate
+            axis.m_rate = 0;
+            axis.m_slewRampActive = false;
+            if (wasMoving[axisIndex]) enable = true;
+        }
+
+        if (enable && cmdEnableMotors(true)) updateAxes(all, sampled);
+
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            Axis &axis = m_axes[axisIndex];
+
+            // An axis still in goto mode is followed by manageAxis as usual
+            if (sampled[axisIndex] && isAxisEnabledAndSlewing(axisIndex)) {
+                if (wasGoto[axisIndex] && axis.m_position != axis.m_gotoTarget) {
+                    GotoTrajectory trajectory;
+                    trajectory.plan(m_gotoLimits, axis.m_gotoTarget - axis.m_position, BREXOS2_COUNTS_PER_SEC_PER_RATE);
+                    startGoTo(axisIndex, axis.m_gotoTarget, trajectory);
+                } else {
+                    int rate = axis.getRequestedRate();
+
+                    if (rate <= -BREXOS2_SLEW_RAMP_THRESHOLD_RATE || rate >= BREXOS2_SLEW_RAMP_THRESHOLD_RATE) {
+                        axis.m_slewRampActive = true;
+                    } else {
+                        axis.m_slewRampActive = false;
+                        cmdSlew(axisIndex, rate);
+                    }
+                }
+            }
+
+            if (sampled[axisIndex]) axis.m_gotoDeferred = false; // Started or not, it's not waiting for the device
+
+            dprintf("Axis %u restored: status=%02X, goto=%d, rate=%d\n", axisIndex, axis.m_status, wasGoto[axisIndex],
+                    axis.m_rate);
+            axis.m_nextPoll = monotonicNs();
+            publishAxis(axisIndex);
+        }
+    }
+
+    /* Manager thread only */
+    void runCommands() {
+        Brexos2Command command;
+
+        while (m_mailbox.pop(command)) {
+            m_metrics.m_commandWait.recordNs(monotonicNs() - command.m_submitTime);
+            __atomic_fetch_add(&m_metrics.m_commands, 1, __ATOMIC_RELAXED);
+
+            bool result = runCommand(command);
+
+            if (command.m_completion != NULL) {
+                command.m_completion->signal(result);
+            } else {
+                if (!result) {
+                    __atomic_fetch_add(&m_metrics.m_asyncFailures, 1, __ATOMIC_RELAXED);
+                    fprintf(stderr, "Posted command %u on axis %u failed\n", command.m_type, command.m_axisIndex);
+                }
+
+                releasePosted(command);
+            }
+        }
+    }
+
+    /* The outcome of a posted command is published by now, frontends stop reporting it as pending */
+    void releasePosted(const Brexos2Command &command) {
+        if (command.m_type == BREXOS2_CMD_GOTO) {
+            __atomic_fetch_sub(&m_pendingGotos[command.m_axisIndex], 1, __ATOMIC_RELEASE);
+        } else if (command.m_type == BREXOS2_CMD_GOTO_SYNC) {
+            __atomic_fetch_sub(&m_pendingGotos[0], 1, __ATOMIC_RELEASE);
+            __atomic_fetch_sub(&m_pendingGotos[1], 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    bool runCommand(const Brexos2Command &command) {
+        Brexos2Completion *completion = command.m_completion;
+        uint8_t axisIndex = command.m_axisIndex;
+
+        switch (command.m_type) {
+            case BREXOS2_CMD_ENABLE: return runEnableMotors(command.m_param != 0);
+            case BREXOS2_CMD_TRACK: return runTrack(axisIndex, command.m_rate);
+            case BREXOS2_CMD_SLEW: return runSlew(axisIndex, command.m_rate);
+            case BREXOS2_CMD_GOTO: return runGoTo(axisIndex, command.m_param);
+            case BREXOS2_CMD_GOTO_SYNC: return runGoToSync(command.m_param, command.m_param2);
+            case BREXOS2_CMD_0F: return cmdParam0f(axisIndex, command.m_param);
+
+            case BREXOS2_CMD_INQUIRY: {
+                uint8_t status;
+                int count;
+                if (!cmdInquiry(axisIndex, status, count)) return false;
+
+                if (completion != NULL) {
+                    completion->m_status = status;
+                    completion->m_value = count;
+                }
+
+                return true;
+            }
+            case BREXOS2_CMD_10: {
+                unsigned value;
+                if (!cmdParam10(axisIndex, value)) return false;
+
+                if (completion != NULL) completion->m_value = value;
+                return true;
+            }
+            case BREXOS2_CMD_PRINT:
+                m_axes[0].print(0);
+                m_axes[1].print(1);
+                return true;
+        }
+
+        return false;
+    }
+
+    /* Fails commands nobody is going to run anymore */
+    void failCommands() {
+        Brexos2Command command;
+
+        while (m_mailbox.pop(command)) {
+            if (command.m_completion != NULL) {
+                command.m_completion->signal(false);
+            } else {
+                releasePosted(command);
+            }
+        }
+    }
+
+    bool runEnableMotors(bool enable) {
+        bool result = cmdEnableMotors(enable);
+
+        // Pick up the new motor state right away
+        int64_t now = monotonicNs();
+        m_axes[0].m_nextPoll = now;
+        m_axes[1].m_nextPoll = now;
         return result;
     }
 
-    bool track(uint8_t axisIndex, int rate) {
-        if (pthread_mutex_lock(&m_managerMutex) != 0) return false;
+    bool runTrack(uint8_t axisIndex, int rate) {
         bool result = false;
         Axis &axis = m_axes[axisIndex];
 
         if (rate < 0) rate = -rate;
 
         do {
-            if (!updateAxis(axisIndex, axis)) break;
+            if (!updateAxis(axisIndex)) break;
 
             if (axis.m_status & BREXOS2_AXIS_STATUS_DISABLED) {
                 if (rate != 0) {
@@ -182,17 +828,26 @@ class Brexos2Direct {
 
         axis.m_trackingRate = rate;
         axis.m_currentTrackingRate = rate;
-        pthread_mutex_unlock(&m_managerMutex);
+        if (m_state != NULL) m_state->setTrackingRate(axisIndex, rate);
+        rescheduleAxis(axisIndex);
+        publishAxis(axisIndex);
         return result;
     }
 
-    bool slew(uint8_t axisIndex, int rate) {
-        if (pthread_mutex_lock(&m_managerMutex) != 0) return false;
+    bool runSlew(uint8_t axisIndex, int rate) {
         bool result = false;
         Axis &axis = m_axes[axisIndex];
 
+        // New slew supersedes the rate waiting for a backlash take-up, and a goto waiting for the device
+        axis.m_backlashDeadline = 0;
+        axis.m_gotoDeferred = false;
+
         do {
-            if (!updateAxis(axisIndex, axis)) break;
+            if (axis.canGuideFromCache(rate, monotonicNs())) {
+                __atomic_fetch_add(&m_metrics.m_guideFastPaths, 1, __ATOMIC_RELAXED);
+            } else if (!updateAxis(axisIndex)) {
+                break;
+            }
 
             if (axis.m_status & BREXOS2_AXIS_STATUS_DISABLED) {
                 if (rate == 0 && axis.m_trackingRate == 0) {
@@ -234,12 +889,20 @@ class Brexos2Direct {
                     uint8_t newDirection = newRate > 0 ? 1 : 0;
 
                     if (newDirection != currentDirection) {
-                        // Backlash compensation
+                        // Backlash compensation, manager thread sends the new rate when the take-up is done
                         dprintf("Backlash compensation: %d\n", axis.m_backlashComp);
-                        cmdSlew(axisIndex, newDirection ? axis.m_backlashComp : -axis.m_backlashComp);
+                        result = cmdSlew(axisIndex, newDirection ? axis.m_backlashComp : -axis.m_backlashComp);
+
+                        if (result) {
+                            axis.m_backlashDeadline = monotonicNs() + BREXOS2_BACKLASH_TAKEUP_MS * NS_PER_MS;
+                            axis.m_backlashPendingRate = newRate;
+
+                            if (axis.m_backlashDeadline < axis.m_nextPoll) {
+                                axis.m_nextPoll = axis.m_backlashDeadline;
+                            }
+                        }
 
-                        timespec sleepInterval = { 0, 100 /* MS */ * 1000000L };
-                        nanosleep(&sleepInterval, NULL);
+                        break;
                     }
                 }
 
@@ -252,166 +915,167 @@ class Brexos2Direct {
         } while (0);
 
         m_axes[axisIndex].m_slewRate = rate;
-        pthread_mutex_unlock(&m_managerMutex);
+        rescheduleAxis(axisIndex);
+        publishAxis(axisIndex);
         return result;
     }
 
-    bool inquiry(uint8_t axis, uint8_t& status, int& count) {
-        bool result = false;
+    bool runGoTo(uint8_t axisIndex, int target) {
+        GotoTrajectory trajectory;
+        bool result = prepareGoTo(axisIndex);
 
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            result = cmdInquiry(axis, status, count);
-            pthread_mutex_unlock(&m_managerMutex);
+        if (result) {
+            trajectory.plan(m_gotoLimits, target - m_axes[axisIndex].m_position, BREXOS2_COUNTS_PER_SEC_PER_RATE);
+            result = startGoTo(axisIndex, target, trajectory);
+        } else {
+            result = deferGoTo(axisIndex, target);
         }
 
+        rescheduleAxis(axisIndex);
+        publishAxis(axisIndex);
         return result;
     }
 
-    bool goTo(uint8_t axisIndex, int rate, int target) {
-        if (pthread_mutex_lock(&m_managerMutex) != 0) return false;
-        bool result = false;
-
-        do {
-            uint8_t status;
-            int position;
-
-            result = cmdInquiry(axisIndex, status, position);
+    bool runGoToSync(int raTarget, int decTarget) {
+        const int targets[2] = { raTarget, decTarget };
+        GotoTrajectory trajectories[2];
+        bool result = prepareGoTo(0) && prepareGoTo(1);
 
-            if (status & BREXOS2_AXIS_STATUS_DISABLED) {
-                if (!cmdEnableMotors(true)) break;
-            }
-
-            if (result && (status & BREXOS2_AXIS_STATUS_SLEWING)) {
-                Axis &axis = m_axes[axisIndex];
-                axis.m_gotoStart = position;
-                axis.m_gotoTarget = target;
-                axis.m_gotoRate = BREXOS2_MIN_GOTO_RATE;
-                axis.m_rate = 0;
-                result = cmdGoTo(axisIndex, axis.m_gotoRate, (unsigned) target);
+        if (result) {
+            for (int axisIndex = 0; axisIndex < 2; axisIndex++) {
+                trajectories[axisIndex].plan(m_gotoLimits, targets[axisIndex] - m_axes[axisIndex].m_position,
+                        BREXOS2_COUNTS_PER_SEC_PER_RATE);
             }
-        } while (0);
-
-        pthread_mutex_unlock(&m_managerMutex);
-        return result;
-    }
-
-    bool getAxisRate(uint8_t axisIndex, int& rate) {
-        bool result = false;
 
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            result = updateAxis(axisIndex);
+            // Longer goto runs flat out, the shorter one is stretched to the same duration
+            int longer = trajectories[0].duration() >= trajectories[1].duration() ? 0 : 1;
+            int shorter = 1 - longer;
+            double duration = trajectories[longer].duration();
+            double shorterDuration = trajectories[shorter].duration();
 
-            if (result) {
-                const Axis &axis = m_axes[axisIndex];
-
-                if (axis.m_status & BREXOS2_AXIS_STATUS_DISABLED) {
-                    rate = 0;
-                } else {
-                    rate = (axis.m_status & BREXOS2_AXIS_STATUS_SLEWING) ? axis.m_slewRate : axis.m_gotoRate * 25;
-                }
+            if (shorterDuration > 0 && duration > shorterDuration) {
+                trajectories[shorter].plan(m_gotoLimits.stretched(duration / shorterDuration),
+                        targets[shorter] - m_axes[shorter].m_position, BREXOS2_COUNTS_PER_SEC_PER_RATE);
             }
 
-            pthread_mutex_unlock(&m_managerMutex);
-        }
+            dprintf("Synchronized goto: duration=%.1f s\n", duration);
 
-        return result;
-    }
-
-    bool cmd0f(uint8_t axisIndex, unsigned param) {
-        bool result = false;
+            bool raResult = startGoTo(0, raTarget, trajectories[0]);
+            bool decResult = startGoTo(1, decTarget, trajectories[1]);
+            result = raResult && decResult;
+        } else {
+            result = deferGoTo(0, raTarget) && deferGoTo(1, decTarget);
+        }
 
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x03, (uint8_t) (axisIndex << 5 | 0x0f), (uint8_t) (param >> 8), (uint8_t) param };
-            uint8_t buf[16];
-            result = writeCommand(cmd, sizeof(cmd), buf, sizeof(buf));
-            pthread_mutex_unlock(&m_managerMutex);
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            rescheduleAxis(axisIndex);
+            publishAxis(axisIndex);
         }
 
         return result;
     }
 
-    bool cmd10(uint8_t axisIndex, unsigned &retval) {
-        bool result = false;
-
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x01, (uint8_t) (axisIndex << 5 | 0x10) };
-            uint8_t buf[16];
-
-            if (writeCommand(cmd, sizeof(cmd), buf, sizeof(buf))) {
-                if (buf[3] == 3) {
-                    retval = buf[5];
-                    retval = (retval << 8) | buf[6];
-                    result = true;
-                }
-            }
+    bool prepareGoTo(uint8_t axisIndex) {
+        Axis &axis = m_axes[axisIndex];
+        axis.m_backlashDeadline = 0;
+        bool result = updateAxis(axisIndex);
 
-            pthread_mutex_unlock(&m_managerMutex);
+        if (axis.m_status & BREXOS2_AXIS_STATUS_DISABLED) {
+            if (!cmdEnableMotors(true)) return false;
         }
 
         return result;
     }
 
-    void printAxes() {
-        if (pthread_mutex_lock(&m_managerMutex) == 0) {
-            m_axes[0].print(0);
-            m_axes[1].print(1);
-            pthread_mutex_unlock(&m_managerMutex);
-        }
-    }
-private:
-    static void *managerThreadProc(void *arg) {
-        ((Brexos2Direct *) arg)->manageMount();
-        return NULL;
+    /* Goto requests are ignored while one is already in progress */
+    bool startGoTo(uint8_t axisIndex, int target, const GotoTrajectory &trajectory) {
+        Axis &axis = m_axes[axisIndex];
+        if (!(axis.m_status & BREXOS2_AXIS_STATUS_SLEWING)) return true;
+
+        axis.m_gotoDeferred = false;
+        axis.m_gotoStart = axis.m_position;
+        axis.m_gotoTarget = target;
+        axis.m_gotoStartTime = monotonicNs();
+        axis.m_gotoTrajectory = trajectory;
+        axis.m_gotoRate = BREXOS2_MIN_GOTO_RATE;
+        axis.m_rate = 0;
+        dprintf("Goto plan: axis=%u, distance=%d, duration=%.1f s\n", axisIndex, target - axis.m_position,
+                trajectory.duration());
+
+        if (!cmdGoTo(axisIndex, axis.m_gotoRate, (unsigned) target)) return deferGoTo(axisIndex, target);
+
+        // Status sampled before the goto, or before enabling the motors for it, would report the axis as idle
+        axis.m_status &= ~(BREXOS2_AXIS_STATUS_SLEWING | BREXOS2_AXIS_STATUS_DISABLED);
+        return true;
     }
 
-    void manageMount() {
-        timespec sleepInterval = { 0, 100 /* MS */ * 1000000L };
+    /* A goto that failed because the serial device is gone is started by restoreMotion() once it's back */
+    bool deferGoTo(uint8_t axisIndex, int target) {
+        if (m_link.isConnected()) return false;
 
-        while (nanosleep(&sleepInterval, NULL) == 0) {
-            if (pthread_mutex_lock(&m_managerMutex) != 0) break;
+        dprintf("Goto deferred: axis=%u, target=%d\n", axisIndex, target);
+        m_axes[axisIndex].m_gotoTarget = target;
+        m_axes[axisIndex].m_gotoDeferred = true;
+        return true;
+    }
 
-            manageAxis(0);
-            manageAxis(1);
-            managePowerSave();
-            pthread_mutex_unlock(&m_managerMutex);
-            m_tickCount++;
-        }
+    /* Polls sooner if a command changed what the axis is doing, right away if the controller's view is unknown */
+    void rescheduleAxis(uint8_t axisIndex) {
+        Axis &axis = m_axes[axisIndex];
+        int64_t now = monotonicNs();
+        int64_t nextPoll = now + (axis.m_statusStale ? BREXOS2_POLL_FAST_MS * NS_PER_MS : axis.getPollInterval(now));
+
+        if (nextPoll < axis.m_nextPoll) axis.m_nextPoll = nextPoll;
     }
 
     bool isAxisEnabledAndSlewing(int axis) {
         return (m_axes[axis].m_status & (BREXOS2_AXIS_STATUS_DISABLED | BREXOS2_AXIS_STATUS_SLEWING)) == BREXOS2_AXIS_STATUS_SLEWING;
     }
 
-    void managePowerSave() {
+    void managePowerSave(int64_t now) {
         if (isAxisEnabledAndSlewing(0) && isAxisEnabledAndSlewing(1)) {
             if (m_axes[0].m_rate == 0 && m_axes[1].m_rate == 0) {
-                if (m_axesIdleCount++ >= 100) { // ~10 sec
+                if (m_idleSince == 0) {
+                    m_idleSince = now;
+                } else if (now - m_idleSince >= BREXOS2_POWER_SAVE_DELAY_MS * NS_PER_MS) {
+                    traceInstant(TRACE_POWER_SAVE);
                     cmdEnableMotors(false);
+                    m_idleSince = 0;
+                    m_axes[0].m_nextPoll = now;
+                    m_axes[1].m_nextPoll = now;
                 }
 
                 return;
             }
         }
 
-        m_axesIdleCount = 0;
+        m_idleSince = 0;
     }
 
-    void manageAxis(uint8_t axisIndex) {
+    /* Axis has just been sampled, motion frames are batched */
+    void manageAxis(uint8_t axisIndex, int64_t now) {
         Axis &axis = m_axes[axisIndex];
-        if (!cmdInquiry(axisIndex, axis.m_status, axis.m_position)) return;
 
         if (axis.m_status & BREXOS2_AXIS_STATUS_DISABLED) {
             axis.m_rate = 0;
+            axis.m_backlashDeadline = 0;
+            return;
+        }
+
+        if (axis.m_backlashDeadline != 0) {
+            if (now < axis.m_backlashDeadline) return;
+
+            dprintf("Backlash take-up done, rate=%d\n", axis.m_backlashPendingRate);
+            axis.m_backlashDeadline = 0;
+            cmdSlew(axisIndex, axis.m_backlashPendingRate);
             return;
         }
 
         if (!(axis.m_status & BREXOS2_AXIS_STATUS_SLEWING)) {
             if (axis.m_gotoTarget != axis.m_gotoStart) {
-                // Goto ramp
-                int distance1 = abs(axis.m_gotoTarget - axis.m_position);
-                int distance2 = abs(axis.m_position - axis.m_gotoStart);
-                int distance = distance1 < distance2 ? distance1 : distance2;
-                int rate = round(sqrt(distance) * 10.0);
+                // Goto ramp, follows the profile planned when the goto started
+                double elapsed = (now - axis.m_gotoStartTime) * 1e-9;
+                int rate = round(axis.m_gotoTrajectory.rate(elapsed, axis.m_gotoTarget - axis.m_position));
 
                 if (rate < BREXOS2_MIN_GOTO_RATE) {
                     rate = BREXOS2_MIN_GOTO_RATE;
@@ -419,7 +1083,14 @@ private:
                     rate = BREXOS2_MAX_GOTO_RATE;
                 }
 
+                // Small rate changes aren't worth a frame, reaching the final approach rate always is
+                if (rate != BREXOS2_MIN_GOTO_RATE
+                        && abs(rate - axis.m_gotoRate) * 100 < axis.m_gotoRate * BREXOS2_GOTO_RATE_HYSTERESIS_PERCENT) {
+                    rate = axis.m_gotoRate;
+                }
+
                 axis.m_gotoRate = rate;
+                traceInstant(TRACE_GOTO_RAMP, rate);
                 dprintf("Goto ramp: status=%02X start=%08X, end=%08X, rate=%u\n", axis.m_status, axis.m_gotoStart,
                         axis.m_gotoTarget, axis.m_gotoRate);
 
@@ -441,6 +1112,7 @@ private:
 
                 if (axis.m_rate != rate) {
                     dprintf("Slew ramp: status=%02X, rate=%d\n", axis.m_status, rate);
+                    traceInstant(TRACE_SLEW_RAMP, rate);
                     cmdSlew(axisIndex, rate);
                 }
             } else if (axis.m_trackingRate != 0) {
@@ -467,17 +1139,75 @@ private:
     }
 
     bool updateAxis(int axisIndex) {
-        Axis& axis = m_axes[axisIndex];
-        return cmdInquiry(axisIndex, axis.m_status, axis.m_position);
+        bool due[2] = { axisIndex == 0, axisIndex == 1 };
+        bool sampled[2];
+        updateAxes(due, sampled);
+        return sampled[axisIndex];
     }
 
-    bool updateAxis(int axisIndex, Axis &axis) {
-        return cmdInquiry(axisIndex, axis.m_status, axis.m_position);
+    /* Inquires the due axes with a single write, the controllers answer back to back */
+    void updateAxes(const bool due[2], bool sampled[2]) {
+        SerialTransaction txs[2];
+        SerialTransaction *batch[2];
+        int numBatched = 0;
+
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            sampled[axisIndex] = false;
+            if (!due[axisIndex]) continue;
+
+            const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x01, (uint8_t) (axisIndex << 5 | 4) };
+            txs[axisIndex] = SerialTransaction(cmd, sizeof(cmd));
+            batch[numBatched++] = &txs[axisIndex];
+        }
+
+        if (numBatched == 0) return;
+        m_link.executeBatch(batch, numBatched);
+
+        for (uint8_t axisIndex = 0; axisIndex < 2; axisIndex++) {
+            const SerialTransaction &tx = txs[axisIndex];
+            Axis &axis = m_axes[axisIndex];
+            if (!due[axisIndex] || !tx.m_result) continue;
+            if (!parseInquiry(tx.m_response, axis.m_status, axis.m_position)) continue;
+
+            // Controller latched the count after the frame arrived and before it answered
+            axis.m_statusStale = false;
+            axis.m_sampleTime = tx.m_writeStart + (tx.m_firstByteTime - tx.m_writeStart) / 2;
+            axis.m_estimator.update(axis.m_sampleTime, axis.m_position, axis.getCommandedVelocity());
+            sampled[axisIndex] = true;
+        }
+    }
+
+    /* Manager thread only, or before it starts */
+    void publishAxis(uint8_t axisIndex) {
+        Axis &axis = m_axes[axisIndex];
+        Brexos2AxisState state;
+
+        // Commands sent since the last sample take effect from now on
+        axis.m_estimator.setVelocity(monotonicNs(), axis.getCommandedVelocity());
+
+        state.m_sampleTime = axis.m_sampleTime;
+        state.m_position = axis.m_position;
+        state.m_rate = axis.getReportedRate();
+        state.m_status = axis.m_status;
+        state.m_gotoTarget = axis.m_gotoTarget;
+        state.m_trackingRate = axis.m_trackingRate;
+        state.m_estimateTime = axis.m_estimator.time();
+        state.m_estimatePosition = axis.m_estimator.position();
+        state.m_estimateVelocity = axis.m_estimator.velocity();
+        state.m_estimateResidual = axis.m_estimator.residual();
+        m_axisStates[axisIndex].store(state);
     }
 
     bool cmdEnableMotors(bool enable) {
         const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x01, (uint8_t) (enable ? 0xff : 0x00) };
-        return m_fd.writeFully(cmd, sizeof(cmd));
+        SerialTransaction tx(cmd, sizeof(cmd), false);
+
+        // Controller drops its motion state
+        m_axes[0].m_lastCommandLen = 0;
+        m_axes[1].m_lastCommandLen = 0;
+        m_axes[0].m_statusStale = true;
+        m_axes[1].m_statusStale = true;
+        return m_link.execute(&tx);
     }
 
     bool cmdGoTo(uint8_t axis, int rate, unsigned target) {
@@ -486,25 +1216,28 @@ private:
         const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x06, (uint8_t) (axis << 5 | 2),
                 (uint8_t) (rate >> 8), (uint8_t) rate,
                 (uint8_t) (target >> 16), (uint8_t) (target >> 8), (uint8_t) target };
-        uint8_t buf[16];
-        return writeCommand(cmd, sizeof(cmd), buf, sizeof(buf));
+
+        uint8_t status = m_axes[axis].m_status;
+        bool applied = !(status & (BREXOS2_AXIS_STATUS_SLEWING | BREXOS2_AXIS_STATUS_DISABLED));
+        m_axes[axis].m_statusStale = true;
+        return writeMotionCommand(axis, cmd, sizeof(cmd), applied);
     }
 
     bool cmdInquiry(uint8_t axis, uint8_t& status, int& count) {
         const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x01, (uint8_t) (axis << 5 | 4) };
         uint8_t buf[16];
 
-        if (writeCommand(cmd, sizeof(cmd), buf, sizeof(buf))) {
-            if (buf[3] == 5) {
-                status = buf[5];
-                count = (int8_t) buf[6];
-                count = (count << 8) | buf[7];
-                count = (count << 8) | buf[8];
-                return true;
-            }
-        }
+        return writeCommand(cmd, sizeof(cmd), buf, sizeof(buf)) && parseInquiry(buf, status, count);
+    }
 
-        return false;
+    static bool parseInquiry(const uint8_t *response, uint8_t& status, int& count) {
+        if (response[3] != 5) return false;
+
+        status = response[5];
+        count = (int8_t) response[6];
+        count = (count << 8) | response[7];
+        count = (count << 8) | response[8];
+        return true;
     }
 
     /* NB! Always update axis status before calling this */
@@ -527,45 +1260,103 @@ private:
 
         const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x04, (uint8_t) (axis << 5 | 1), direction,
                 (uint8_t) (rateToUse >> 8), (uint8_t) rateToUse };
-        uint8_t buf[16];
         m_axes[axis].m_rate = rate;
-        return writeCommand(cmd, sizeof(cmd), buf, sizeof(buf));
+
+        bool applied = isAxisEnabledAndSlewing(axis) && (rateToUse == 0 || m_axes[axis].getDirection() == direction);
+        if (!writeMotionCommand(axis, cmd, sizeof(cmd), applied)) return false;
+
+        // Guide pulses build their frames from the cached status, so it follows reversals until the next sample
+        if (direction) {
+            m_axes[axis].m_status &= ~BREXOS2_AXIS_STATUS_DIRECTION;
+        } else {
+            m_axes[axis].m_status |= BREXOS2_AXIS_STATUS_DIRECTION;
+        }
+
+        return true;
     }
 
-    bool readResponse(uint8_t *buf, int len) {
-        int numRead = m_fd.readAtLeast(buf, len, 4);
+    /*
+     * Skips a frame identical to the last one sent to the axis while the controller status still reflects it.
+     * Repeats are sent anyway after BREXOS2_COMMAND_REFRESH_MS, so that a lost frame gets corrected.
+     */
+    bool writeMotionCommand(uint8_t axisIndex, const uint8_t *cmd, int cmdLen, bool applied) {
+        Axis &axis = m_axes[axisIndex];
+        int64_t now = monotonicNs();
 
-        if (numRead == -1) {
-            fputs("readAtLeast failed\n", stderr);
-            return false;
+        if (applied && cmdLen == axis.m_lastCommandLen && memcmp(cmd, axis.m_lastCommand, cmdLen) == 0
+                && now - axis.m_lastCommandTime < BREXOS2_COMMAND_REFRESH_MS * NS_PER_MS) {
+            __atomic_fetch_add(&m_metrics.m_suppressedFrames, 1, __ATOMIC_RELAXED);
+            return true;
         }
 
-        if (buf[0] == 0x55 && buf[1] == 0xaa && buf[2] == 0x01) {
-            int packetLen = buf[3];
-            int numToRead = packetLen + 4 - numRead;
+        if (m_batchMotion) {
+            if (m_numMotionBatched == BREXOS2_MOTION_BATCH_SIZE) flushMotion();
+            m_motionBatch[m_numMotionBatched++] = SerialTransaction(cmd, cmdLen);
+        } else {
+            uint8_t buf[16];
 
-            if (numToRead > 0) {
-                if (m_fd.readAtLeast(buf + numRead, len - numRead, numToRead) == -1) {
-                    fputs("Second readAtLeast failed\n", stderr);
-                    return false;
-                }
+            if (!writeCommand(cmd, cmdLen, buf, sizeof(buf))) {
+                axis.m_lastCommandLen = 0;
+                axis.m_statusStale = true;
+                return false;
             }
+        }
 
-#if 0
-            for (int i = 4; i < packetLen + 4; i++) {
-                fprintf(stderr, "%02x ", buf[i]);
-            }
+        // Batched frames count as sent, flushMotion() forgets them if they fail
+        memcpy(axis.m_lastCommand, cmd, cmdLen);
+        axis.m_lastCommandLen = cmdLen;
+        axis.m_lastCommandTime = now;
+        return true;
+    }
 
-            fputc('\n', stderr);
-#endif
-            return true;
+    /* Writes the batched motion frames together */
+    void flushMotion() {
+        SerialTransaction *batch[BREXOS2_MOTION_BATCH_SIZE];
+
+        for (int i = 0; i < m_numMotionBatched; i++) {
+            batch[i] = &m_motionBatch[i];
+        }
+
+        if (m_numMotionBatched != 0) m_link.executeBatch(batch, m_numMotionBatched);
+
+        for (int i = 0; i < m_numMotionBatched; i++) {
+            if (m_motionBatch[i].m_result) continue;
+
+            // Cached direction may already reflect the lost frame
+            Axis &axis = m_axes[m_motionBatch[i].getAxis()];
+            axis.m_lastCommandLen = 0;
+            axis.m_statusStale = true;
+        }
+
+        m_numMotionBatched = 0;
+    }
+
+    bool cmdParam0f(uint8_t axisIndex, unsigned param) {
+        const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x03, (uint8_t) (axisIndex << 5 | 0x0f), (uint8_t) (param >> 8), (uint8_t) param };
+        uint8_t buf[16];
+        return writeCommand(cmd, sizeof(cmd), buf, sizeof(buf));
+    }
+
+    bool cmdParam10(uint8_t axisIndex, unsigned &retval) {
+        const uint8_t cmd[] = { 0x55, 0xaa, 0x01, 0x01, (uint8_t) (axisIndex << 5 | 0x10) };
+        uint8_t buf[16];
+
+        if (writeCommand(cmd, sizeof(cmd), buf, sizeof(buf))) {
+            if (buf[3] == 3) {
+                retval = buf[5];
+                retval = (retval << 8) | buf[6];
+                return true;
+            }
         }
 
         return false;
     }
 
     bool writeCommand(const uint8_t *cmd, int cmdLen, uint8_t *response, int responseLen) {
-        if (!m_fd.writeFully(cmd, cmdLen)) return false;
-        return readResponse(response, responseLen);
+        SerialTransaction tx(cmd, cmdLen);
+        if (!m_link.execute(&tx)) return false;
+
+        memcpy(response, tx.m_response, responseLen < (int) sizeof(tx.m_response) ? responseLen : sizeof(tx.m_response));
+        return true;
     }
 };
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include "clock.cpp"
+
+#define ESTIMATOR_ALPHA 0.85                 // Share of the residual applied to position
+#define ESTIMATOR_BETA 0.1                   // Share of the residual velocity applied to the bias
+#define ESTIMATOR_MAX_BIAS_RATIO 0.1         // Bias never exceeds 10% of the commanded velocity
+#define ESTIMATOR_MAX_SAMPLE_GAP_NS (2 * NS_PER_SEC)
+
+/*
+ * Alpha-beta filter tracking an axis count between inquiries. Velocity is the commanded one plus a small
+ * learned bias, so that a rate change takes effect immediately while a consistent mismatch between the
+ * nominal and the actual motor speed is corrected from sample to sample.
+ */
+class PositionEstimator {
+    int64_t m_time;       // CLOCK_MONOTONIC ns of the estimate, 0 if not initialized
+    double m_position;    // Counts
+    double m_velocity;    // Counts per second, commanded
+    double m_bias;        // Counts per second
+    double m_residual;    // Counts, last measured minus predicted
+
+public:
+    PositionEstimator(): m_time(0), m_position(0), m_velocity(0), m_bias(0), m_residual(0) {
+    }
+
+    void reset(int64_t time, int position, double velocity) {
+        m_time = time;
+        m_position = position;
+        m_velocity = velocity;
+        m_bias = 0;
+        m_residual = 0;
+    }
+
+    /* Corrects the estimate with a count measured at the given time */
+    void update(int64_t time, int measured, double velocity) {
+        int64_t dt = time - m_time;
+
+        if (m_time == 0 || dt <= 0 || dt > ESTIMATOR_MAX_SAMPLE_GAP_NS) {
+            reset(time, measured, velocity);
+            return;
+        }
+
+        double seconds = dt * 1e-9;
+        double predicted = m_position + (m_velocity + m_bias) * seconds;
+        m_residual = measured - predicted;
+
+        m_position = predicted + ESTIMATOR_ALPHA * m_residual;
+        m_time = time;
+
+        // Bias only makes sense relative to an unchanged commanded velocity
+        if (velocity != m_velocity || velocity == 0) {
+            m_bias = 0;
+        } else {
+            double maxBias = (velocity < 0 ? -velocity : velocity) * ESTIMATOR_MAX_BIAS_RATIO;
+            m_bias += ESTIMATOR_BETA * m_residual / seconds;
+            if (m_bias > maxBias) m_bias = maxBias;
+            if (m_bias < -maxBias) m_bias = -maxBias;
+        }
+
+        m_velocity = velocity;
+    }
+
+    /* Commanded velocity changed between samples, extrapolate from the current estimate */
+    void setVelocity(int64_t time, double velocity) {
+        if (m_time == 0 || velocity == m_velocity) return;
+
+        if (time > m_time) {
+            m_position += (m_velocity + m_bias) * (time - m_time) * 1e-9;
+            m_time = time;
+        }
+
+        m_velocity = velocity;
+        m_bias = 0;
+    }
+
+    int64_t time() const {
+        return m_time;
+    }
+
+    double position() const {
+        return m_position;
+    }
+
+    double velocity() const {
+        return m_velocity + m_bias;
+    }
+
+    double residual() const {
+        return m_residual;
+    }
+};
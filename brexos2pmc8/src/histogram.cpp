@@ -0,0 +1,113 @@
+#pragma once
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_MSB 26 // ~67 s in microseconds
+#define HISTOGRAM_NUM_BUCKETS ((HISTOGRAM_MAX_MSB - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * Log-linear (HDR style) histogram of microsecond values with fixed buckets. Recording is a few relaxed atomic
+ * adds, so it can be updated from the I/O path and read concurrently without locks or allocation.
+ * Bucket error is at most 1/8 of the value.
+ */
+class Histogram {
+    uint64_t m_counts[HISTOGRAM_NUM_BUCKETS];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+
+public:
+    Histogram(): m_counts(), m_count(0), m_sum(0), m_max(0) {
+    }
+
+    static unsigned bucketIndex(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+        unsigned msb = 63 - __builtin_clzll(value);
+        if (msb > HISTOGRAM_MAX_MSB) return HISTOGRAM_NUM_BUCKETS - 1;
+
+        unsigned shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+        unsigned sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+
+    /* Largest value that falls into the bucket */
+    static uint64_t bucketUpperBound(unsigned index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+        unsigned shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t lower = (uint64_t) (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+        return lower + ((uint64_t) 1 << shift) - 1;
+    }
+
+    void record(int64_t value) {
+        if (value < 0) value = 0;
+
+        __atomic_fetch_add(&m_counts[bucketIndex(value)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m_sum, value, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m_count, 1, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&m_max, __ATOMIC_RELAXED);
+        while ((uint64_t) value > max
+                && !__atomic_compare_exchange_n(&m_max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    void recordNs(int64_t ns) {
+        record(ns / 1000);
+    }
+
+    uint64_t count() const {
+        return __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t sum() const {
+        return __atomic_load_n(&m_sum, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max() const {
+        return __atomic_load_n(&m_max, __ATOMIC_RELAXED);
+    }
+
+    uint64_t bucketCount(unsigned index) const {
+        return __atomic_load_n(&m_counts[index], __ATOMIC_RELAXED);
+    }
+
+    /* Number of values in buckets that lie entirely at or below the given value */
+    uint64_t countAtOrBelow(uint64_t value) const {
+        uint64_t total = 0;
+
+        for (unsigned i = 0; i < HISTOGRAM_NUM_BUCKETS && bucketUpperBound(i) <= value; i++) {
+            total += bucketCount(i);
+        }
+
+        return total;
+    }
+
+    /* Upper bound of the bucket holding the given percentile, 0 if empty */
+    uint64_t percentile(double percentile) const {
+        uint64_t total = 0;
+
+        for (unsigned i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+            total += bucketCount(i);
+        }
+
+        if (total == 0) return 0;
+
+        uint64_t rank = (uint64_t) (percentile / 100.0 * total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+
+        for (unsigned i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+            seen += bucketCount(i);
+
+            if (seen >= rank) {
+                uint64_t bound = bucketUpperBound(i);
+                uint64_t maxValue = max();
+                return bound < maxValue ? bound : maxValue;
+            }
+        }
+
+        return max();
+    }
+};
@@ -1,30 +1,84 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "debug.cpp"
 #include "fd.cpp"
 #include "brexos2.cpp"
 #include "pmc8server.cpp"
 #include "webserver.cpp"
 
+#define DEFAULT_DEVICE_PATH "/dev/ttyUSB0"
+#define DEFAULT_PMC8_PORT 8888
+#define DEFAULT_TRACE_PATH "/tmp/brexos2pmc8-trace.json"
+
 int main(int argc, char **argv) {
+    TraceDumper traceDumper; // Started before any other thread, they must inherit its blocked signal
+    SerialRecorder recorder; // Outlives the mount, whose serial thread writes to it
+    SessionState state;      // Likewise for the manager thread
     Brexos2Direct mount;
     int exitCode = 1;
+    const char *devicePath = DEFAULT_DEVICE_PATH;
+    int port = DEFAULT_PMC8_PORT;
+    const char *tracePath = DEFAULT_TRACE_PATH;
+    const char *statePath = NULL;
+    int gotoRate, gotoAcceleration, gotoJerk;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:p:g:r:t:s:")) != -1) {
+        switch (opt) {
+            case 'd': devicePath = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'g':
+                if (sscanf(optarg, "%d,%d,%d", &gotoRate, &gotoAcceleration, &gotoJerk) != 3) {
+                    fputs("Goto limits must be rate,acceleration,jerk\n", stderr);
+                    return exitCode;
+                }
+
+                mount.setGotoLimits(gotoRate, gotoAcceleration, gotoJerk);
+                break;
+            case 'r':
+                if (!recorder.open(optarg)) return exitCode;
+                mount.setRecorder(&recorder);
+                break;
+            case 't': tracePath = optarg; break;
+            case 's': statePath = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-d device] [-p port] [-g rate,acceleration,jerk] [-r recording] [-t trace] "
+                        "[-s state]\n", argv[0]);
+                return exitCode;
+        }
+    }
+
+    traceThreadName("pmc8");
+
+    if (!traceDumper.start(tracePath)) {
+        fputs("Cannot start trace dumper\n", stderr);
+        return exitCode;
+    }
+
+    if (statePath != NULL) {
+        if (!state.open(statePath)) return exitCode;
+        mount.setState(&state);
+    }
 
-    if (!mount.init("/dev/ttyUSB0")) {
+    if (!mount.init(devicePath)) {
         fputs("Cannot connect to mount\n", stderr);
         return exitCode;
     }
 
-    WebServer webserver;
+    Pmc8Server server(mount);
+    if (recorder.isOpen()) server.setRecorder(&recorder);
+    if (statePath != NULL) server.setState(&state);
+    WebServer webserver(mount, server);
 
     if (!webserver.init("ws://localhost:8889")) {
         fputs("Web server init failed\n", stderr);
         return exitCode;
     }
 
-    Pmc8Server server(mount);
     int result = 1;
 
-    if (server.init(8888)) {
+    if (server.init(port)) {
         dputs("Running...");
         server.run();
         exitCode = 0;
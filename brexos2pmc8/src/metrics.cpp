@@ -0,0 +1,216 @@
+#pragma once
+#include <stdio.h>
+#include <stdarg.h>
+#include "clock.cpp"
+#include "histogram.cpp"
+#include "brexos2.cpp"
+#include "pmc8server.cpp"
+
+class TextBuffer {
+    char *m_data;
+    int m_size;
+    int m_len;
+
+public:
+    TextBuffer(char *data, int size): m_data(data), m_size(size), m_len(0) {
+    }
+
+    const char *data() const {
+        return m_data;
+    }
+
+    int length() const {
+        return m_len;
+    }
+
+    void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        if (m_len >= m_size) return;
+
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(m_data + m_len, m_size - m_len, fmt, args);
+        va_end(args);
+
+        if (n > 0) {
+            m_len += n;
+            if (m_len > m_size) m_len = m_size; // Truncated
+        }
+    }
+};
+
+/*
+ * Renders mount, serial link and PMC8 server state in Prometheus text format. Reads only atomic counters and
+ * the published axis snapshots, never waits for the manager thread.
+ */
+class MetricsRenderer {
+    TextBuffer &m_out;
+
+public:
+    MetricsRenderer(TextBuffer &out): m_out(out) {
+    }
+
+    void render(const Brexos2Direct &mount, const Pmc8Server &server) {
+        renderSerial(mount.getSerialStats());
+        renderManager(mount.getMetrics());
+        renderAxes(mount);
+        renderPmc8(server.getMetrics());
+    }
+
+private:
+    void renderSerial(const SerialStats &stats) {
+        static const char *const counters[] = {
+            "brexos2_serial_transactions_total", "brexos2_serial_failures_total",
+            "brexos2_serial_bytes_written_total", "brexos2_serial_bytes_read_total"
+        };
+
+        for (unsigned counter = 0; counter < sizeof(counters) / sizeof(counters[0]); counter++) {
+            m_out.printf("# TYPE %s counter\n", counters[counter]);
+
+            forEachSerialOp(stats, [&](const SerialOpStats &opStats, const char *labels) {
+                uint64_t values[] = { opStats.count(), opStats.failures(), opStats.bytesWritten(), opStats.bytesRead() };
+                m_out.printf("%s{%s} %llu\n", counters[counter], labels, (unsigned long long) values[counter]);
+            });
+        }
+
+        m_out.printf("# TYPE brexos2_serial_discarded_bytes_total counter\n");
+        m_out.printf("brexos2_serial_discarded_bytes_total %llu\n", (unsigned long long) stats.discardedBytes());
+        m_out.printf("# TYPE brexos2_serial_reconnects_total counter\n");
+        m_out.printf("brexos2_serial_reconnects_total %llu\n", (unsigned long long) stats.reconnects());
+
+        renderSerialHistogram(stats, "brexos2_serial_queue_wait_seconds", &SerialOpStats::m_queueWait);
+        renderSerialHistogram(stats, "brexos2_serial_write_seconds", &SerialOpStats::m_writeTime);
+        renderSerialHistogram(stats, "brexos2_serial_first_byte_seconds", &SerialOpStats::m_firstByte);
+        renderSerialHistogram(stats, "brexos2_serial_round_trip_seconds", &SerialOpStats::m_roundTrip);
+    }
+
+    void renderSerialHistogram(const SerialStats &stats, const char *name, Histogram SerialOpStats::*histogram) {
+        m_out.printf("# TYPE %s histogram\n", name);
+
+        forEachSerialOp(stats, [&](const SerialOpStats &opStats, const char *labels) {
+            renderHistogramSeries(name, labels, opStats.*histogram);
+        });
+    }
+
+    template <typename F>
+    void forEachSerialOp(const SerialStats &stats, F f) {
+        for (int op = 0; op < SERIAL_OP_COUNT; op++) {
+            for (int axis = 0; axis < 2; axis++) {
+                const SerialOpStats &opStats = stats.m_ops[op][axis];
+                if (opStats.count() == 0) continue;
+
+                char labels[64];
+                snprintf(labels, sizeof(labels), "op=\"%s\",axis=\"%d\"", serialOpNames[op], axis);
+                f(opStats, labels);
+            }
+        }
+    }
+
+    void renderManager(const Brexos2Metrics &metrics) {
+        m_out.printf("# TYPE brexos2_manager_ticks_total counter\n");
+        m_out.printf("brexos2_manager_ticks_total %llu\n", (unsigned long long) metrics.ticks());
+        m_out.printf("# TYPE brexos2_manager_commands_total counter\n");
+        m_out.printf("brexos2_manager_commands_total %llu\n", (unsigned long long) metrics.commands());
+        m_out.printf("# TYPE brexos2_manager_mailbox_full_total counter\n");
+        m_out.printf("brexos2_manager_mailbox_full_total %llu\n", (unsigned long long) metrics.mailboxFull());
+        m_out.printf("# TYPE brexos2_manager_suppressed_frames_total counter\n");
+        m_out.printf("brexos2_manager_suppressed_frames_total %llu\n", (unsigned long long) metrics.suppressedFrames());
+        m_out.printf("# TYPE brexos2_manager_guide_fast_paths_total counter\n");
+        m_out.printf("brexos2_manager_guide_fast_paths_total %llu\n", (unsigned long long) metrics.guideFastPaths());
+        m_out.printf("# TYPE brexos2_manager_async_failures_total counter\n");
+        m_out.printf("brexos2_manager_async_failures_total %llu\n", (unsigned long long) metrics.asyncFailures());
+        renderHistogram("brexos2_manager_tick_duration_seconds", metrics.m_tickDuration);
+        renderHistogram("brexos2_manager_tick_jitter_seconds", metrics.m_tickJitter);
+        renderHistogram("brexos2_manager_command_wait_seconds", metrics.m_commandWait);
+    }
+
+    void renderAxes(const Brexos2Direct &mount) {
+        Brexos2AxisState states[2];
+        bool valid[2];
+        int64_t now = monotonicNs();
+
+        for (int axis = 0; axis < 2; axis++) {
+            valid[axis] = mount.getAxisState(axis, states[axis]);
+        }
+
+        m_out.printf("# TYPE brexos2_axis_position_counts gauge\n");
+        for (int axis = 0; axis < 2; axis++) {
+            if (valid[axis]) m_out.printf("brexos2_axis_position_counts{axis=\"%d\"} %d\n", axis, states[axis].m_position);
+        }
+
+        m_out.printf("# TYPE brexos2_axis_estimate_residual_counts gauge\n");
+        for (int axis = 0; axis < 2; axis++) {
+            if (valid[axis]) {
+                m_out.printf("brexos2_axis_estimate_residual_counts{axis=\"%d\"} %.1f\n", axis,
+                        states[axis].m_estimateResidual);
+            }
+        }
+
+        m_out.printf("# TYPE brexos2_axis_rate gauge\n");
+        for (int axis = 0; axis < 2; axis++) {
+            if (valid[axis]) m_out.printf("brexos2_axis_rate{axis=\"%d\"} %d\n", axis, states[axis].m_rate);
+        }
+
+        m_out.printf("# TYPE brexos2_axis_status gauge\n");
+        for (int axis = 0; axis < 2; axis++) {
+            if (valid[axis]) m_out.printf("brexos2_axis_status{axis=\"%d\"} %u\n", axis, states[axis].m_status);
+        }
+
+        m_out.printf("# TYPE brexos2_axis_sample_age_seconds gauge\n");
+        for (int axis = 0; axis < 2; axis++) {
+            if (valid[axis]) {
+                m_out.printf("brexos2_axis_sample_age_seconds{axis=\"%d\"} %.6f\n", axis,
+                        (now - states[axis].m_sampleTime) * 1e-9);
+            }
+        }
+    }
+
+    void renderPmc8(const Pmc8Metrics &metrics) {
+        m_out.printf("# TYPE pmc8_commands_total counter\n");
+
+        for (int command = 0; command < PMC8_CMD_COUNT; command++) {
+            m_out.printf("pmc8_commands_total{command=\"%s\"} %llu\n", pmc8CommandNames[command],
+                    (unsigned long long) metrics.commands(command));
+        }
+
+        m_out.printf("# TYPE pmc8_connections_total counter\n");
+        m_out.printf("pmc8_connections_total %llu\n", (unsigned long long) metrics.connections());
+        m_out.printf("# TYPE pmc8_sync_gotos_total counter\n");
+        m_out.printf("pmc8_sync_gotos_total %llu\n", (unsigned long long) metrics.syncGotos());
+        m_out.printf("# TYPE pmc8_sessions_active gauge\n");
+        m_out.printf("pmc8_sessions_active %d\n", metrics.activeSessions());
+    }
+
+    void renderHistogram(const char *name, const Histogram &histogram) {
+        m_out.printf("# TYPE %s histogram\n", name);
+        renderHistogramSeries(name, NULL, histogram);
+    }
+
+    /* Histogram values are microseconds, exported in seconds */
+    void renderHistogramSeries(const char *name, const char *labels, const Histogram &histogram) {
+        static const uint64_t bounds[] = {
+            100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+        };
+        const char *separator = labels != NULL ? "," : "";
+        if (labels == NULL) labels = "";
+
+        uint64_t count = histogram.count();
+
+        for (unsigned i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+            uint64_t bucketCount = histogram.countAtOrBelow(bounds[i]);
+            if (bucketCount > count) bucketCount = count; // Concurrent update
+
+            m_out.printf("%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, separator, bounds[i] * 1e-6,
+                    (unsigned long long) bucketCount);
+        }
+
+        m_out.printf("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, (unsigned long long) count);
+
+        if (*labels != 0) {
+            m_out.printf("%s_sum{%s} %.6f\n", name, labels, histogram.sum() * 1e-6);
+            m_out.printf("%s_count{%s} %llu\n", name, labels, (unsigned long long) count);
+        } else {
+            m_out.printf("%s_sum %.6f\n", name, histogram.sum() * 1e-6);
+            m_out.printf("%s_count %llu\n", name, (unsigned long long) count);
+        }
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Bounded lock-free multi-producer single-consumer queue (Vyukov). Each cell carries a sequence number telling
+ * whether it is free for the producer at that position or holds a value for the consumer, so producers only
+ * contend on one compare-and-swap and never wait for each other. SIZE must be a power of 2.
+ */
+template <typename T, unsigned SIZE>
+class MpscQueue {
+    static_assert((SIZE & (SIZE - 1)) == 0, "Size must be a power of 2");
+
+    struct Cell {
+        uint32_t m_sequence;
+        T m_value;
+    };
+
+    Cell m_cells[SIZE];
+    uint32_t m_enqueuePos __attribute__((aligned(64)));
+    uint32_t m_dequeuePos __attribute__((aligned(64)));
+
+public:
+    MpscQueue(): m_enqueuePos(0), m_dequeuePos(0) {
+        for (unsigned i = 0; i < SIZE; i++) {
+            m_cells[i].m_sequence = i;
+        }
+    }
+
+    /* Any thread, returns false if full */
+    bool push(const T &value) {
+        uint32_t pos = __atomic_load_n(&m_enqueuePos, __ATOMIC_RELAXED);
+
+        while (true) {
+            Cell &cell = m_cells[pos & (SIZE - 1)];
+            uint32_t sequence = __atomic_load_n(&cell.m_sequence, __ATOMIC_ACQUIRE);
+            int32_t diff = (int32_t) (sequence - pos);
+
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&m_enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                        __ATOMIC_RELAXED)) {
+                    cell.m_value = value;
+                    __atomic_store_n(&cell.m_sequence, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = __atomic_load_n(&m_enqueuePos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    /* Consumer thread only, returns false if empty */
+    bool pop(T &value) {
+        Cell &cell = m_cells[m_dequeuePos & (SIZE - 1)];
+        uint32_t sequence = __atomic_load_n(&cell.m_sequence, __ATOMIC_ACQUIRE);
+
+        if ((int32_t) (sequence - (m_dequeuePos + 1)) < 0) return false;
+
+        value = cell.m_value;
+        __atomic_store_n(&cell.m_sequence, m_dequeuePos + SIZE, __ATOMIC_RELEASE);
+        m_dequeuePos++;
+        return true;
+    }
+};
@@ -1,47 +1,139 @@
 #pragma once
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <math.h>
 #include "debug.cpp"
 #include "fd.cpp"
 #include "brexos2.cpp"
+#include "ringbuffer.cpp"
+#include "recorder.cpp"
+#include "trace.cpp"
+#include "state.cpp"
 
 #define BR2ES_STEP_RATIO (48.0 / 38.0)
 
+#define PMC8_MAX_SESSIONS 16
+#define PMC8_MAX_COMMAND_LEN 16
+#define PMC8_INPUT_BUFFER_SIZE 256
+#define PMC8_OUTPUT_BUFFER_SIZE 512
+#define PMC8_GOTO_COALESCE_MS 100 // ASIAIR sends ESPt0 and ESPt1 back to back
+
+enum Pmc8Command {
+    PMC8_CMD_GV,
+    PMC8_CMD_GD,
+    PMC8_CMD_GP,
+    PMC8_CMD_GR,
+    PMC8_CMD_PT,
+    PMC8_CMD_SD,
+    PMC8_CMD_SP,
+    PMC8_CMD_SR,
+    PMC8_CMD_TR,
+    PMC8_CMD_UNKNOWN,
+    PMC8_CMD_COUNT
+};
+
+static const char *const pmc8CommandNames[PMC8_CMD_COUNT] = {
+    "ESGv", "ESGd", "ESGp", "ESGr", "ESPt", "ESSd", "ESSp", "ESSr", "ESTr", "unknown"
+};
+
+/* Counters are written by the server thread only and read with relaxed atomics */
+struct Pmc8Metrics {
+    uint64_t m_commands[PMC8_CMD_COUNT];
+    uint64_t m_connections;
+    uint64_t m_syncGotos;
+    int m_activeSessions;
+
+    Pmc8Metrics(): m_commands(), m_connections(0), m_syncGotos(0), m_activeSessions(0) {
+    }
+
+    uint64_t commands(int command) const {
+        return __atomic_load_n(&m_commands[command], __ATOMIC_RELAXED);
+    }
+
+    uint64_t connections() const {
+        return __atomic_load_n(&m_connections, __ATOMIC_RELAXED);
+    }
+
+    uint64_t syncGotos() const {
+        return __atomic_load_n(&m_syncGotos, __ATOMIC_RELAXED);
+    }
+
+    int activeSessions() const {
+        return __atomic_load_n(&m_activeSessions, __ATOMIC_RELAXED);
+    }
+};
+
 struct Axis {
-    unsigned m_direction;
     int m_target;
     int m_offset;
+    unsigned m_direction;    // Last set by any session, new sessions start with it
+    bool m_gotoPending;
+    int m_pendingGotoTarget; // Mount counts
+
+    Axis(): m_target(0), m_offset(0), m_direction(0), m_gotoPending(false), m_pendingGotoTarget(0) {
+    }
+};
 
-    Axis(): m_direction(0), m_target(0), m_offset(0) {
+/* Per-client state, the mount and sync offsets are shared by all sessions */
+struct Pmc8Session {
+    FileDescriptor m_fd;
+    int m_slot;
+    unsigned m_direction[2];
+    RingBuffer<PMC8_INPUT_BUFFER_SIZE> m_input;
+    char m_output[PMC8_OUTPUT_BUFFER_SIZE];
+    int m_outputLen;
+    uint32_t m_events;  // Registered with epoll
+
+    Pmc8Session(int fd, int slot): m_fd(fd), m_slot(slot), m_outputLen(0), m_events(EPOLLIN | EPOLLRDHUP) {
+        m_direction[0] = 0;
+        m_direction[1] = 0;
     }
 };
 
 class Pmc8Server {
     int m_serverSocket;
+    FileDescriptor m_epoll;
     Brexos2Direct& m_mount;
     Axis m_axes[2];
+    Pmc8Session *m_sessions[PMC8_MAX_SESSIONS];
+    int64_t m_gotoDeadline; // Pending gotos are started by then at the latest
+    Pmc8Metrics m_metrics;
+    SerialRecorder *m_recorder;
+    SessionState *m_state;
 public:
-    Pmc8Server(Brexos2Direct& mount): m_serverSocket(-1), m_mount(mount) {
+    Pmc8Server(Brexos2Direct& mount): m_serverSocket(-1), m_mount(mount), m_gotoDeadline(0), m_recorder(NULL),
+            m_state(NULL) {
+        for (int i = 0; i < PMC8_MAX_SESSIONS; i++) {
+            m_sessions[i] = NULL;
+        }
     }
 
     ~Pmc8Server() {
+        for (int i = 0; i < PMC8_MAX_SESSIONS; i++) {
+            delete m_sessions[i];
+        }
+
         if (m_serverSocket != -1) {
             close(m_serverSocket);
         }
     }
 
     bool init(int port) {
-        m_serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+        m_serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
         if (m_serverSocket == -1) {
             fputs("Cannot create PMC8 socket", stderr);
-            return -1;
+            return false;
         }
 
+        int reuse = 1;
+        setsockopt(m_serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
         sockaddr_in addr;
         addr.sin_family = AF_INET;
         addr.sin_port = htons(port);
@@ -52,11 +144,30 @@ public:
             goto err;
         }
 
-        if (listen(m_serverSocket, 1) == -1) {
+        if (listen(m_serverSocket, PMC8_MAX_SESSIONS) == -1) {
             fprintf(stderr, "Listen failed on socket %d\n", m_serverSocket);
             goto err;
         }
 
+        m_epoll.set(epoll_create1(EPOLL_CLOEXEC));
+
+        if (m_epoll == -1) {
+            fputs("Cannot create epoll instance\n", stderr);
+            goto err;
+        }
+
+        {
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL; // Listening socket
+
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_serverSocket, &event) == -1) {
+                fputs("Cannot add PMC8 socket to epoll\n", stderr);
+                m_epoll.close();
+                goto err;
+            }
+        }
+
         return true;
     err:
         close(m_serverSocket);
@@ -64,162 +175,383 @@ public:
         return false;
     }
 
+    /* Port actually bound, differs from the requested one if that was 0 */
+    int getPort() const {
+        sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        if (getsockname(m_serverSocket, (sockaddr*)&addr, &addrlen) == -1) return -1;
+        return ntohs(addr.sin_port);
+    }
+
+    /* Call before run, commands and responses are then recorded along with the serial traffic */
+    void setRecorder(SerialRecorder *recorder) {
+        m_recorder = recorder;
+    }
+
+    /* Call before run, sync offsets and directions are then restored from it and kept in it */
+    void setState(SessionState *state) {
+        m_state = state;
+
+        for (int axis = 0; axis < 2; axis++) {
+            m_axes[axis].m_offset = state->syncOffset(axis);
+            m_axes[axis].m_direction = state->direction(axis);
+        }
+    }
+
+    const Pmc8Metrics& getMetrics() const {
+        return m_metrics;
+    }
+
+    static Pmc8Command classifyCommand(const char *buf, int len) {
+        if (len < 4) return PMC8_CMD_UNKNOWN;
+
+        for (int i = 0; i < PMC8_CMD_UNKNOWN; i++) {
+            if (memcmp(buf, pmc8CommandNames[i], 4) == 0) return (Pmc8Command) i;
+        }
+
+        return PMC8_CMD_UNKNOWN;
+    }
+
     void run() {
+        epoll_event events[PMC8_MAX_SESSIONS + 1];
+
+        while (true) {
+            int timeout = -1;
+
+            if (isGotoPending()) {
+                int64_t remaining = m_gotoDeadline - monotonicNs();
+                timeout = remaining > 0 ? (remaining + NS_PER_MS - 1) / NS_PER_MS : 0;
+            }
+
+            int numEvents = epoll_wait(m_epoll, events, PMC8_MAX_SESSIONS + 1, timeout);
+
+            if (numEvents == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "epoll_wait failed: %d\n", errno);
+                break;
+            }
+
+            for (int i = 0; i < numEvents; i++) {
+                Pmc8Session *session = (Pmc8Session *) events[i].data.ptr;
+
+                if (session == NULL) {
+                    acceptClients();
+                } else if (!serviceSession(*session, events[i].events)) {
+                    closeSession(session);
+                }
+            }
+
+            if (isGotoPending() && monotonicNs() >= m_gotoDeadline) {
+                startPendingGoTo();
+            }
+        }
+    }
+
+private:
+    void acceptClients() {
         while (true) {
             sockaddr_in addr;
             socklen_t addrlen = sizeof(addr);
-            int clientSocket = accept(m_serverSocket, (sockaddr*)&addr, &addrlen);
+            int clientSocket = accept4(m_serverSocket, (sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
             if (clientSocket == -1) {
-                fprintf(stderr, "Connection to client failed: %d\n", errno);
-            } else {
-                dputs("Connected to client");
-                FileDescriptor clientSocketFd(clientSocket);
-                runClientLoop(clientSocketFd);
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr, "Connection to client failed: %d\n", errno);
+                }
+                return;
+            }
+
+            int slot = 0;
+            while (slot < PMC8_MAX_SESSIONS && m_sessions[slot] != NULL) slot++;
+
+            if (slot == PMC8_MAX_SESSIONS) {
+                fputs("Too many PMC8 clients\n", stderr);
+                close(clientSocket);
+                continue;
             }
+
+            int noDelay = 1;
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+            Pmc8Session *session = new Pmc8Session(clientSocket, slot);
+            session->m_direction[0] = m_axes[0].m_direction;
+            session->m_direction[1] = m_axes[1].m_direction;
+            epoll_event event;
+            event.events = session->m_events;
+            event.data.ptr = session;
+
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+                fprintf(stderr, "Cannot add client %d to epoll: %d\n", clientSocket, errno);
+                delete session;
+                continue;
+            }
+
+            m_sessions[slot] = session;
+            __atomic_fetch_add(&m_metrics.m_connections, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&m_metrics.m_activeSessions, 1, __ATOMIC_RELAXED);
+            dprintf("Connected to client %d\n", clientSocket);
         }
     }
 
-private:
-    void runClientLoop(FileDescriptor &fd) {
-        char buf[16];
-        const char *response;
-        int responseLen;
+    void closeSession(Pmc8Session *session) {
+        for (int i = 0; i < PMC8_MAX_SESSIONS; i++) {
+            if (m_sessions[i] == session) m_sessions[i] = NULL;
+        }
+
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, session->m_fd, NULL);
+        __atomic_fetch_sub(&m_metrics.m_activeSessions, 1, __ATOMIC_RELAXED);
+        dprintf("Disconnected client %d\n", (int) session->m_fd);
+        delete session;
+    }
 
+    /* Returns false when the session should be closed */
+    bool serviceSession(Pmc8Session &session, uint32_t events) {
+        if ((events & EPOLLIN) && session.m_input.space() != 0) {
+            ssize_t nread = session.m_input.readFrom(session.m_fd);
+
+            if (nread == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            } else if (nread == 0) {
+                return false;
+            }
+        } else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+            return false;
+        }
+
+        // Commands held back while the output was full are dispatched as it drains
         while (true) {
-            int nread = fd.read(buf, sizeof(buf));
-            if (nread <= 4) break;
-
-            response = buf;
-            responseLen = 0;
-            dprintf("%.*s\n", nread, buf);
-
-            if (buf[0] != 'E' || buf[1] != 'S' || buf[nread - 1] != '!') continue;
-
-            switch (buf[2]) {
-                case 'G':
-                    switch (buf[3]) {
-                        case 'd': {
-                            if (nread == 6) {
-                                int axis = buf[4] - '0';
-                                getAxisCurrentDirection(axis, buf, sizeof(buf), &responseLen);
-                            }
-                            break;
-                        }
-                        case 'v': {
-                            response = "ESGvES6B10A0!";
-                            responseLen = 13; 
-                            break;
+            unsigned pending = session.m_input.size();
+            processInput(session);
+            if (!writeOutput(session)) return false;
+            if (session.m_outputLen != 0 || session.m_input.size() == pending) break;
+        }
+
+        return watchSession(session);
+    }
+
+    /*
+     * Dispatches the complete commands in the input buffer and queues the responses. Commands may arrive
+     * coalesced or split across reads, only the '!' terminator delimits them. Stops while the output buffer has no
+     * room for another response, the rest stays buffered until the client reads.
+     */
+    void processInput(Pmc8Session &session) {
+        RingBuffer<PMC8_INPUT_BUFFER_SIZE> &input = session.m_input;
+
+        // No response is longer than PMC8_MAX_COMMAND_LEN
+        while (input.size() != 0 && session.m_outputLen + PMC8_MAX_COMMAND_LEN <= PMC8_OUTPUT_BUFFER_SIZE) {
+            // Drop garbage in front of the next command
+            if (input[0] != 'E') {
+                int start = input.find('E');
+                input.consume(start == -1 ? input.size() : start);
+                continue;
+            }
+
+            int end = input.find('!');
+
+            if (end == -1) {
+                if (input.size() >= PMC8_MAX_COMMAND_LEN) {
+                    input.consume(1); // Too long to be a command, resync at next 'E'
+                    continue;
+                }
+                break; // Incomplete, wait for more data
+            }
+
+            int cmdLen = end + 1;
+
+            if (cmdLen > PMC8_MAX_COMMAND_LEN) {
+                input.consume(1);
+                continue;
+            }
+
+            char buf[PMC8_MAX_COMMAND_LEN];
+            input.peek(buf, cmdLen);
+            input.consume(cmdLen);
+
+            if (m_recorder != NULL) m_recorder->record(RECORD_PMC8_COMMAND, buf, cmdLen, monotonicNs(), session.m_slot);
+
+            const char *response = buf;
+            traceBegin(TRACE_PMC8_COMMAND, traceText(buf + 2, cmdLen - 3));
+            int responseLen = processCommand(session, buf, cmdLen, sizeof(buf), &response);
+            traceEnd(TRACE_PMC8_COMMAND);
+            dprintf("%.*s\n\n", responseLen, response);
+
+            if (m_recorder != NULL) {
+                m_recorder->record(RECORD_PMC8_RESPONSE, response, responseLen, monotonicNs(), session.m_slot);
+            }
+
+            memcpy(session.m_output + session.m_outputLen, response, responseLen);
+            session.m_outputLen += responseLen;
+        }
+    }
+
+    /* Writes all queued responses with one syscall */
+    bool writeOutput(Pmc8Session &session) {
+        if (session.m_outputLen != 0) {
+            ssize_t numWritten = write(session.m_fd, session.m_output, session.m_outputLen);
+
+            if (numWritten == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                numWritten = 0;
+            }
+
+            session.m_outputLen -= numWritten;
+            memmove(session.m_output, session.m_output + numWritten, session.m_outputLen);
+        }
+
+        return true;
+    }
+
+    /* Waits for EPOLLOUT while responses are queued, and stops reading while the input buffer is full */
+    bool watchSession(Pmc8Session &session) {
+        uint32_t events = EPOLLRDHUP;
+        if (session.m_input.space() != 0) events |= EPOLLIN;
+        if (session.m_outputLen != 0) events |= EPOLLOUT;
+
+        if (events != session.m_events) {
+            epoll_event event;
+            event.events = events;
+            event.data.ptr = &session;
+            if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, session.m_fd, &event) == -1) return false;
+            session.m_events = events;
+        }
+
+        return true;
+    }
+
+    /* Parses command in buf, builds response in place and returns its length */
+    int processCommand(Pmc8Session &session, char *buf, int nread, int bufSize, const char **responsePtr) {
+        const char *&response = *responsePtr;
+        int responseLen = 0;
+        dprintf("%.*s\n", nread, buf);
+
+        __atomic_fetch_add(&m_metrics.m_commands[classifyCommand(buf, nread)], 1, __ATOMIC_RELAXED);
+
+        if (buf[0] != 'E' || buf[1] != 'S' || buf[nread - 1] != '!') return 0;
+
+        // Only another goto joins one that is still being coalesced, moves must not overtake it and queries must see it
+        if (buf[2] != 'P' && isGotoPending()) startPendingGoTo();
+
+        switch (buf[2]) {
+            case 'G':
+                switch (buf[3]) {
+                    case 'd': {
+                        if (nread == 6) {
+                            int axis = buf[4] - '0';
+                            getAxisCurrentDirection(session, axis, buf, bufSize, &responseLen);
                         }
-                        case 'p': {
-                            if (nread == 6) {
-                                int axis = buf[4] - '0';
-                                getAxisCurrentPosition(axis, buf, sizeof(buf), &responseLen);
-                            }
-                            break;
+                        break;
+                    }
+                    case 'v': {
+                        response = "ESGvES6B10A0!";
+                        responseLen = 13; 
+                        break;
+                    }
+                    case 'p': {
+                        if (nread == 6) {
+                            int axis = buf[4] - '0';
+                            getAxisCurrentPosition(axis, buf, bufSize, &responseLen);
                         }
-                        case 'r': {
-                            if (nread == 6) {
-                                int axis = buf[4] - '0';
-                                getAxisCurrentRate(axis, buf, sizeof(buf), &responseLen);
-                            }
-                            break;
+                        break;
+                    }
+                    case 'r': {
+                        if (nread == 6) {
+                            int axis = buf[4] - '0';
+                            getAxisCurrentRate(axis, buf, bufSize, &responseLen);
                         }
+                        break;
                     }
-                    break;
-                case 'P':
-                    switch (buf[3]) {
-                        case 't': {
-                            if (nread == 12) {
-                                int axis = buf[4] - '0';
-                                unsigned tmp = parseUInt((uint8_t*)(buf + 5), 6);
-                                int target = ((int32_t)(tmp << 8)) >> 8;
-                                goTo(axis, target);
-                                buf[2] = 'G';
-                                responseLen = 12;
-                            }
-                            break;
+                }
+                break;
+            case 'P':
+                switch (buf[3]) {
+                    case 't': {
+                        if (nread == 12) {
+                            int axis = buf[4] - '0';
+                            unsigned tmp = parseUInt((uint8_t*)(buf + 5), 6);
+                            int target = ((int32_t)(tmp << 8)) >> 8;
+                            goTo(axis, target);
+                            buf[2] = 'G';
+                            responseLen = 12;
                         }
+                        break;
                     }
-                    break;
-                case 'S':
-                    switch (buf[3]) {
-                        case 'd': {
-                            if (nread == 7) {
-                                int axis = buf[4] - '0';
-                                int direction = buf[5] - '0';
-
-                                if (axis >= 0 && axis <= 1 && direction >= 0 && direction <= 1) {
-                                    m_axes[axis].m_direction = direction;
-                                }
-
-                                buf[2] = 'G';
-                                responseLen = 7;
+                }
+                break;
+            case 'S':
+                switch (buf[3]) {
+                    case 'd': {
+                        if (nread == 7) {
+                            int axis = buf[4] - '0';
+                            int direction = buf[5] - '0';
+
+                            if (axis >= 0 && axis <= 1 && direction >= 0 && direction <= 1) {
+                                session.m_direction[axis] = direction;
+                                m_axes[axis].m_direction = direction;
+                                if (m_state != NULL) m_state->setDirection(axis, direction);
                             }
-                            break;
+
+                            buf[2] = 'G';
+                            responseLen = 7;
                         }
-                        case 'p': {
-                            // Set Axis Position Value
-                            if (nread == 12) {
-                                int axis = buf[4] - '0';
-                                unsigned tmp = parseUInt((uint8_t*)(buf + 5), 6);
-                                int pos = ((int32_t)(tmp << 8)) >> 8;
-                                setAxisPosition(axis, pos);
-                                buf[2] = 'G';
-                                responseLen = 12;
-                            }
-                            break;
+                        break;
+                    }
+                    case 'p': {
+                        // Set Axis Position Value
+                        if (nread == 12) {
+                            int axis = buf[4] - '0';
+                            unsigned tmp = parseUInt((uint8_t*)(buf + 5), 6);
+                            int pos = ((int32_t)(tmp << 8)) >> 8;
+                            setAxisPosition(axis, pos);
+                            buf[2] = 'G';
+                            responseLen = 12;
                         }
-                        case 'r': {
-                            if (nread == 10) {
-                                int axis = buf[4] - '0';
-                                unsigned rate = parseUInt((uint8_t *)(buf + 5), 4);
-                                setAxisSlewRate(axis, rate);
-                                buf[2] = 'G';
-                                responseLen = 10;
-                            }
-                            break;
+                        break;
+                    }
+                    case 'r': {
+                        if (nread == 10) {
+                            int axis = buf[4] - '0';
+                            unsigned rate = parseUInt((uint8_t *)(buf + 5), 4);
+                            setAxisSlewRate(session, axis, rate);
+                            buf[2] = 'G';
+                            responseLen = 10;
                         }
+                        break;
                     }
-                    break;
-                case 'T':
-                     switch (buf[3]) {
-                        case 'r': {
-                            if (nread == 9) {
-                                unsigned rate = parseUInt((unsigned char *)(buf + 4), 4);
-                                setPrecisionTrackingRate(rate);
-                                buf[2] = 'G';
-                                buf[3] = 'x';
-                                responseLen = 9;
-                            }
-                            break;
+                }
+                break;
+            case 'T':
+                 switch (buf[3]) {
+                    case 'r': {
+                        if (nread == 9) {
+                            unsigned rate = parseUInt((unsigned char *)(buf + 4), 4);
+                            setPrecisionTrackingRate(rate);
+                            buf[2] = 'G';
+                            buf[3] = 'x';
+                            responseLen = 9;
                         }
+                        break;
                     }
-                    break;
-            }
-
-            dprintf("%.*s\n\n", responseLen, response);
-            if (!fd.writeFully(response, responseLen)) break;
+                }
+                break;
         }
 
-        dputs("Disconnected");
+        return responseLen;
     }
 
-    void getAxisCurrentDirection(int axisIndex, char *response, int responseMaxLen, int *responseLen) {
+    void getAxisCurrentDirection(Pmc8Session &session, int axisIndex, char *response, int responseMaxLen, int *responseLen) {
         if (!validateAxisIndex(axisIndex)) return;
     
-        int dir = m_axes[axisIndex].m_direction;
+        int dir = session.m_direction[axisIndex];
         *responseLen = snprintf(response, responseMaxLen, "ESGd%d%01X!", axisIndex, dir);
     }
 
     void getAxisCurrentPosition(int axis, char *response, int responseMaxLen, int *responseLen) {
         if (!validateAxisIndex(axis)) return;
 
-        int count;
-        uint8_t status;
+        int position;
 
-        if (m_mount.inquiry(axis, status, count)) {
-            count = round(count * BR2ES_STEP_RATIO) + m_axes[axis].m_offset;
+        if (m_mount.getAxisPosition(axis, position)) {
+            int count = round(position * BR2ES_STEP_RATIO) + m_axes[axis].m_offset;
             *responseLen = snprintf(response, responseMaxLen, "ESGp%d%06X!", axis, count & 0xffffff);
         }
     }
@@ -238,17 +570,18 @@ private:
         return axisIndex >= 0 && axisIndex <= 1;
     }
 
+    /* Syncs to the estimated position ESGp would report now, without waiting for an inquiry */
     void setAxisPosition(int axis, int pos) {
         if (!validateAxisIndex(axis)) return;
 
         dprintf("Axis: %d, new position: %06X\n", axis, pos & 0xffffff);
 
         int count;
-        uint8_t status;
 
-        if (m_mount.inquiry(axis, status, count)) {
-            int pmc8count = count * BR2ES_STEP_RATIO;
+        if (m_mount.getAxisPosition(axis, count)) {
+            int pmc8count = round(count * BR2ES_STEP_RATIO);
             m_axes[axis].m_offset = pos - pmc8count;
+            if (m_state != NULL) m_state->setSyncOffset(axis, m_axes[axis].m_offset);
         }
     }
 
@@ -260,12 +593,12 @@ private:
         dprintf("Tracking rate: %d\n", trackingRate);
 
         if (trackingRate >= 0 && trackingRate < 10) {
-            m_mount.slew(1, 0);  // Stop DEC
-            m_mount.track(0, trackingRate);  // Track RA
+            postSlew(1, 0);  // Stop DEC
+            if (!m_mount.postTrack(0, trackingRate)) fputs("Cannot post tracking rate\n", stderr);
         }
     }
 
-    void setAxisSlewRate(int axis, unsigned rate) {
+    void setAxisSlewRate(Pmc8Session &session, int axis, unsigned rate) {
         if (axis < 0 || axis > 1) {
             return;
         }
@@ -279,9 +612,14 @@ private:
             slewRate = 2;
         }
 
-        if (!m_axes[axis].m_direction) slewRate = -slewRate;
+        if (!session.m_direction[axis]) slewRate = -slewRate;
         dprintf("Axis: %d, slew rate: %d\n", axis, slewRate);
-        m_mount.slew(axis, slewRate);
+        postSlew(axis, slewRate);
+    }
+
+    /* Motion commands are answered right away, the manager thread runs them in order with the gotos */
+    void postSlew(int axis, int rate) {
+        if (!m_mount.postSlew(axis, rate)) fprintf(stderr, "Cannot post slew on axis %d\n", axis);
     }
 
     int convertRateEs2Br(double esRate) {
@@ -292,6 +630,7 @@ private:
         return round(brRate * (38.0 / 5.0) * BR2ES_STEP_RATIO);
     }
 
+    /* Acknowledged right away, started once the other axis' target arrived or the coalescing window closed */
     void goTo(int axis, int target) {
         if (axis < 0 || axis > 1) {
             return;
@@ -300,7 +639,40 @@ private:
         m_axes[axis].m_target = target;
         target = round((target - m_axes[axis].m_offset) / BR2ES_STEP_RATIO);
         dprintf("Goto axis: %d, target=%06X\n", axis, target & 0xffffff);
-        m_mount.goTo(axis, 128 * 5, target); 
+
+        if (!isGotoPending()) m_gotoDeadline = monotonicNs() + PMC8_GOTO_COALESCE_MS * NS_PER_MS;
+
+        m_axes[axis].m_gotoPending = true;
+        m_axes[axis].m_pendingGotoTarget = target;
+
+        if (m_axes[0].m_gotoPending && m_axes[1].m_gotoPending) startPendingGoTo();
+    }
+
+    bool isGotoPending() const {
+        return m_axes[0].m_gotoPending || m_axes[1].m_gotoPending;
+    }
+
+    /*
+     * Queued for the manager thread, the client never waits for the serial round trips of a goto. It was already
+     * acknowledged, so a goto that cannot be queued is only logged, ESGr then reports the axis as not moving.
+     */
+    void startPendingGoTo() {
+        if (m_axes[0].m_gotoPending && m_axes[1].m_gotoPending) {
+            if (m_mount.postGoToSync(m_axes[0].m_pendingGotoTarget, m_axes[1].m_pendingGotoTarget)) {
+                __atomic_fetch_add(&m_metrics.m_syncGotos, 1, __ATOMIC_RELAXED);
+            } else {
+                fputs("Cannot post synchronized goto\n", stderr);
+            }
+        } else {
+            int axis = m_axes[0].m_gotoPending ? 0 : 1;
+
+            if (!m_mount.postGoTo(axis, m_axes[axis].m_pendingGotoTarget)) {
+                fprintf(stderr, "Cannot post goto on axis %d\n", axis);
+            }
+        }
+
+        m_axes[0].m_gotoPending = false;
+        m_axes[1].m_gotoPending = false;
     }
 
     static unsigned parseUInt(const uint8_t *buf, int numDigits) {
@@ -0,0 +1,14 @@
+#pragma once
+
+/* EXOS2 controller protocol, shared by the bridge and the simulator */
+
+#define BREXOS2_AXIS_INDEX_RA 0
+#define BREXOS2_AXIS_INDEX_DEC 1
+
+#define BREXOS2_AXIS_STATUS_SLEWING    0x04
+#define BREXOS2_AXIS_STATUS_DISABLED   0x08
+#define BREXOS2_AXIS_STATUS_DIRECTION  0x80
+
+// Frames are 0x55 0xAA 0x01, a length byte and that many payload bytes
+#define BREXOS2_FRAME_HEADER_LEN 4
+#define BREXOS2_MAX_FRAME_LEN (BREXOS2_FRAME_HEADER_LEN + 255)
@@ -0,0 +1,250 @@
+#pragma once
+#include <cstdio>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "clock.cpp"
+
+#define RECORDER_MAGIC "BR2SREC"
+#define RECORDER_VERSION 1
+#define RECORDER_DEFAULT_CAPACITY (4 * 1024 * 1024)
+
+enum RecordDirection {
+    RECORD_TX = 1,             // Frame written to the mount
+    RECORD_RX = 2,             // Bytes read from the mount
+    RECORD_PMC8_COMMAND = 3,   // Command received from a PMC8 client
+    RECORD_PMC8_RESPONSE = 4,  // Response to it, empty if there was none
+    RECORD_DEVICE_LOST = 5,    // Serial device failed, frames written before got no response. Payload is its path.
+    RECORD_PAD = 0xff          // Fills the end of the ring when the next record doesn't fit
+};
+
+struct RecorderFileHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_capacity;      // Ring bytes following the header
+    uint64_t m_head;          // Logical offset of the next record, ring offset is modulo capacity
+    uint64_t m_tail;          // Logical offset of the oldest record still in the ring
+    int64_t m_startTime;      // CLOCK_MONOTONIC ns when recording started
+    int64_t m_startRealtime;  // CLOCK_REALTIME ns at the same moment
+};
+
+struct RecordHeader {
+    int64_t m_time;           // CLOCK_MONOTONIC ns
+    uint16_t m_length;        // Payload bytes following the header
+    uint8_t m_direction;
+    uint8_t m_session;        // PMC8 session slot, 0 for serial traffic
+} __attribute__((packed));
+
+/*
+ * Records serial and PMC8 traffic into a memory mapped ring file. Records never straddle the end of the ring,
+ * the oldest ones are dropped to make room. Appending is a couple of memcpys into the mapping, the kernel writes
+ * the pages back, so there are no syscalls per frame. The serial I/O thread and the PMC8 server thread both
+ * write, the mutex around an append is practically never contended.
+ */
+class SerialRecorder {
+    uint8_t *m_map;
+    size_t m_mapSize;
+    RecorderFileHeader *m_header;
+    uint8_t *m_ring;
+    uint32_t m_capacity;
+    pthread_mutex_t m_mutex;
+
+public:
+    SerialRecorder(): m_map(NULL), m_mapSize(0), m_header(NULL), m_ring(NULL), m_capacity(0) {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~SerialRecorder() {
+        close();
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    bool open(const char *path, uint32_t capacity = RECORDER_DEFAULT_CAPACITY) {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+            fprintf(stderr, "Cannot create recording %s: %d\n", path, errno);
+            return false;
+        }
+
+        m_mapSize = sizeof(RecorderFileHeader) + capacity;
+
+        if (ftruncate(fd, m_mapSize) == -1) {
+            fprintf(stderr, "Cannot size recording %s: %d\n", path, errno);
+            ::close(fd);
+            return false;
+        }
+
+        void *map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Cannot map recording %s: %d\n", path, errno);
+            return false;
+        }
+
+        m_map = (uint8_t *) map;
+        m_header = (RecorderFileHeader *) m_map;
+        m_ring = m_map + sizeof(RecorderFileHeader);
+        m_capacity = capacity;
+
+        timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+
+        memcpy(m_header->m_magic, RECORDER_MAGIC, sizeof(m_header->m_magic));
+        m_header->m_version = RECORDER_VERSION;
+        m_header->m_capacity = capacity;
+        m_header->m_head = 0;
+        m_header->m_tail = 0;
+        m_header->m_startTime = monotonicNs();
+        m_header->m_startRealtime = realtime.tv_sec * NS_PER_SEC + realtime.tv_nsec;
+        return true;
+    }
+
+    bool isOpen() const {
+        return m_map != NULL;
+    }
+
+    void close() {
+        if (m_map != NULL) {
+            munmap(m_map, m_mapSize);
+            m_map = NULL;
+        }
+    }
+
+    void record(uint8_t direction, const void *data, int len, int64_t time, uint8_t session = 0) {
+        uint32_t size = sizeof(RecordHeader) + len;
+        if (size > m_capacity / 2) return;
+
+        pthread_mutex_lock(&m_mutex);
+        uint64_t head = m_header->m_head;
+        uint32_t offset = head % m_capacity;
+
+        if (offset + size > m_capacity) {
+            // Doesn't fit before the end, pad and wrap
+            uint32_t padding = m_capacity - offset;
+            makeRoom(head, padding);
+
+            if (padding >= sizeof(RecordHeader)) {
+                writeHeader(offset, RECORD_PAD, padding - sizeof(RecordHeader), time, 0);
+            }
+
+            head += padding;
+            offset = 0;
+        }
+
+        makeRoom(head, size);
+        writeHeader(offset, direction, len, time, session);
+        memcpy(m_ring + offset + sizeof(RecordHeader), data, len);
+
+        __atomic_store_n(&m_header->m_head, head + size, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    /* Drops the oldest records until there are size free bytes after head */
+    void makeRoom(uint64_t head, uint32_t size) {
+        uint64_t tail = m_header->m_tail;
+
+        while (m_capacity - (head - tail) < size) {
+            uint32_t offset = tail % m_capacity;
+            uint32_t left = m_capacity - offset;
+
+            if (left < sizeof(RecordHeader)) {
+                tail += left; // Implicit padding, too short for a header
+            } else {
+                RecordHeader header;
+                memcpy(&header, m_ring + offset, sizeof(header));
+                tail += sizeof(RecordHeader) + header.m_length;
+            }
+        }
+
+        __atomic_store_n(&m_header->m_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    void writeHeader(uint32_t offset, uint8_t direction, int len, int64_t time, uint8_t session) {
+        RecordHeader header = { time, (uint16_t) len, direction, session };
+        memcpy(m_ring + offset, &header, sizeof(header));
+    }
+};
+
+/* Read-only view of a recording made by SerialRecorder */
+class SerialRecording {
+    uint8_t *m_map;
+    size_t m_mapSize;
+    const RecorderFileHeader *m_header;
+    const uint8_t *m_ring;
+
+public:
+    SerialRecording(): m_map(NULL), m_mapSize(0), m_header(NULL), m_ring(NULL) {
+    }
+
+    ~SerialRecording() {
+        if (m_map != NULL) munmap(m_map, m_mapSize);
+    }
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1) {
+            fprintf(stderr, "Cannot open recording %s: %d\n", path, errno);
+            return false;
+        }
+
+        off_t size = lseek(fd, 0, SEEK_END);
+        void *map = size >= (off_t) sizeof(RecorderFileHeader)
+                ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Cannot map recording %s: %d\n", path, errno);
+            return false;
+        }
+
+        m_map = (uint8_t *) map;
+        m_mapSize = size;
+        m_header = (const RecorderFileHeader *) m_map;
+        m_ring = m_map + sizeof(RecorderFileHeader);
+
+        if (memcmp(m_header->m_magic, RECORDER_MAGIC, sizeof(m_header->m_magic)) != 0
+                || m_header->m_version != RECORDER_VERSION
+                || sizeof(RecorderFileHeader) + m_header->m_capacity > m_mapSize) {
+            fprintf(stderr, "Not a recording: %s\n", path);
+            return false;
+        }
+
+        return true;
+    }
+
+    const RecorderFileHeader& header() const {
+        return *m_header;
+    }
+
+    /* Calls f(const RecordHeader &, const uint8_t *payload) for each record from the oldest one, skips padding */
+    template <typename F>
+    void forEach(F f) const {
+        uint32_t capacity = m_header->m_capacity;
+        uint64_t head = m_header->m_head;
+
+        for (uint64_t pos = m_header->m_tail; pos < head;) {
+            uint32_t offset = pos % capacity;
+            uint32_t left = capacity - offset;
+
+            if (left < sizeof(RecordHeader)) {
+                pos += left;
+                continue;
+            }
+
+            RecordHeader header;
+            memcpy(&header, m_ring + offset, sizeof(header));
+            if (sizeof(RecordHeader) + header.m_length > left) return; // Truncated or corrupt
+
+            if (header.m_direction != RECORD_PAD) f(header, m_ring + offset + sizeof(RecordHeader));
+            pos += sizeof(RecordHeader) + header.m_length;
+        }
+    }
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+/* Byte FIFO for stream parsing. Not thread safe. */
+template <unsigned SIZE>
+class RingBuffer {
+    static_assert((SIZE & (SIZE - 1)) == 0, "RingBuffer size must be a power of 2");
+
+    uint8_t m_data[SIZE];
+    unsigned m_head;
+    unsigned m_tail;
+
+public:
+    RingBuffer(): m_head(0), m_tail(0) {
+    }
+
+    unsigned size() const {
+        return m_tail - m_head;
+    }
+
+    unsigned space() const {
+        return SIZE - size();
+    }
+
+    uint8_t operator[](unsigned index) const {
+        return m_data[(m_head + index) & (SIZE - 1)];
+    }
+
+    void clear() {
+        m_head = m_tail;
+    }
+
+    void consume(unsigned len) {
+        if (len > size()) len = size();
+        m_head += len;
+    }
+
+    bool append(const void *data, unsigned len) {
+        if (len > space()) return false;
+        const uint8_t *src = (const uint8_t *) data;
+
+        for (unsigned i = 0; i < len; i++) {
+            m_data[m_tail++ & (SIZE - 1)] = src[i];
+        }
+
+        return true;
+    }
+
+    /* Copies up to len bytes from the front without consuming them */
+    unsigned peek(void *dst, unsigned len) const {
+        if (len > size()) len = size();
+        uint8_t *out = (uint8_t *) dst;
+
+        for (unsigned i = 0; i < len; i++) {
+            out[i] = (*this)[i];
+        }
+
+        return len;
+    }
+
+    /* Returns index of the first byte equal to value at or after start, or -1 */
+    int find(uint8_t value, unsigned start = 0) const {
+        for (unsigned i = start; i < size(); i++) {
+            if ((*this)[i] == value) return i;
+        }
+
+        return -1;
+    }
+
+    /* Fills free space from fd with one readv() call, returns its result */
+    ssize_t readFrom(int fd) {
+        unsigned free = space();
+        if (free == 0) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        unsigned start = m_tail & (SIZE - 1);
+        unsigned firstLen = SIZE - start;
+        if (firstLen > free) firstLen = free;
+
+        iovec iov[2];
+        iov[0].iov_base = m_data + start;
+        iov[0].iov_len = firstLen;
+        iov[1].iov_base = m_data;
+        iov[1].iov_len = free - firstLen;
+
+        ssize_t numRead = ::readv(fd, iov, iov[1].iov_len != 0 ? 2 : 1);
+        if (numRead > 0) m_tail += numRead;
+        return numRead;
+    }
+};
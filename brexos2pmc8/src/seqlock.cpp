@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Single writer, multiple reader sequence lock. Readers never block the writer,
+ * they retry when the value changed while they were copying it.
+ * T must be trivially copyable and its size a multiple of 4 bytes. Values go through word arrays with memcpy,
+ * T's own fields are never accessed as uint32_t.
+ */
+template <typename T>
+class SeqLock {
+    static_assert(sizeof(T) % sizeof(uint32_t) == 0, "SeqLock value size must be a multiple of 4");
+
+    uint32_t m_seq;
+    uint32_t m_words[sizeof(T) / sizeof(uint32_t)];
+
+public:
+    SeqLock(): m_seq(0), m_words() {
+    }
+
+    void store(const T& value) {
+        uint32_t src[sizeof(m_words) / sizeof(m_words[0])];
+        memcpy(src, &value, sizeof(src));
+        uint32_t seq = __atomic_load_n(&m_seq, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&m_seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        for (unsigned i = 0; i < sizeof(m_words) / sizeof(m_words[0]); i++) {
+            __atomic_store_n(&m_words[i], src[i], __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&m_seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+    void load(T& value) const {
+        uint32_t dst[sizeof(m_words) / sizeof(m_words[0])];
+        uint32_t seq1, seq2 = 0;
+
+        do {
+            seq1 = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+            if (seq1 & 1) continue;
+
+            for (unsigned i = 0; i < sizeof(m_words) / sizeof(m_words[0]); i++) {
+                dst[i] = __atomic_load_n(&m_words[i], __ATOMIC_RELAXED);
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq2 = __atomic_load_n(&m_seq, __ATOMIC_RELAXED);
+        } while ((seq1 & 1) || seq1 != seq2);
+
+        memcpy(&value, dst, sizeof(dst));
+    }
+
+    uint32_t sequence() const {
+        return __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+    }
+};
@@ -0,0 +1,719 @@
+#pragma once
+#include <cstdio>
+#include <termios.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include "fd.cpp"
+#include "debug.cpp"
+#include "clock.cpp"
+#include "histogram.cpp"
+#include "ringbuffer.cpp"
+#include "recorder.cpp"
+#include "trace.cpp"
+
+#define SERIAL_MAX_FRAME_LEN 16
+#define SERIAL_QUEUE_SIZE 16
+#define SERIAL_MAX_IN_FLIGHT 8
+#define SERIAL_DEFAULT_MAX_IN_FLIGHT 4
+#define SERIAL_RX_BUFFER_SIZE 256
+#define SERIAL_RESPONSE_TIMEOUT_MS 100 // From the write, or the previous response if the frame was queued behind it
+#define SERIAL_REOPEN_MIN_DELAY_MS 20   // Lost device is retried after this, doubling up to the max
+#define SERIAL_REOPEN_MAX_DELAY_MS 500
+
+enum SerialOp {
+    SERIAL_OP_SLEW,
+    SERIAL_OP_GOTO,
+    SERIAL_OP_INQUIRY,
+    SERIAL_OP_0F,
+    SERIAL_OP_10,
+    SERIAL_OP_ENABLE,
+    SERIAL_OP_OTHER,
+    SERIAL_OP_COUNT
+};
+
+static const char *const serialOpNames[SERIAL_OP_COUNT] = { "slew", "goto", "inquiry", "0f", "10", "enable", "other" };
+
+struct SerialOpStats {
+    uint64_t m_count;
+    uint64_t m_failures;
+    uint64_t m_bytesWritten;
+    uint64_t m_bytesRead;
+    Histogram m_queueWait;  // Submit to start of write
+    Histogram m_writeTime;  // write() duration
+    Histogram m_firstByte;  // End of write to first response byte
+    Histogram m_roundTrip;  // Start of write to complete response
+
+    SerialOpStats(): m_count(0), m_failures(0), m_bytesWritten(0), m_bytesRead(0) {
+    }
+
+    uint64_t count() const {
+        return __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t failures() const {
+        return __atomic_load_n(&m_failures, __ATOMIC_RELAXED);
+    }
+
+    uint64_t bytesWritten() const {
+        return __atomic_load_n(&m_bytesWritten, __ATOMIC_RELAXED);
+    }
+
+    uint64_t bytesRead() const {
+        return __atomic_load_n(&m_bytesRead, __ATOMIC_RELAXED);
+    }
+};
+
+/* Transaction statistics keyed by opcode and axis, enable is recorded under axis 0 */
+struct SerialStats {
+    SerialOpStats m_ops[SERIAL_OP_COUNT][2];
+    uint64_t m_discardedBytes; // Line noise and responses nobody was waiting for
+    uint64_t m_reconnects;     // Device reopened after it was lost
+
+    SerialStats(): m_discardedBytes(0), m_reconnects(0) {
+    }
+
+    uint64_t discardedBytes() const {
+        return __atomic_load_n(&m_discardedBytes, __ATOMIC_RELAXED);
+    }
+
+    uint64_t reconnects() const {
+        return __atomic_load_n(&m_reconnects, __ATOMIC_RELAXED);
+    }
+};
+
+struct SerialTransaction {
+    typedef void (*Callback)(SerialTransaction *transaction, void *context);
+
+    uint8_t m_cmd[SERIAL_MAX_FRAME_LEN];
+    int m_cmdLen;
+    bool m_expectResponse;
+    uint8_t m_response[SERIAL_MAX_FRAME_LEN];
+    int m_responseLen;
+    bool m_result;
+    bool m_done;
+    Callback m_callback;
+    void *m_context;
+
+    // CLOCK_MONOTONIC timestamps for statistics
+    int64_t m_submitTime;
+    int64_t m_writeStart;
+    int64_t m_writeEnd;
+    int64_t m_firstByteTime;
+
+    SerialTransaction(): m_cmdLen(0), m_expectResponse(true), m_responseLen(0), m_result(false), m_done(false),
+            m_callback(NULL), m_context(NULL) {
+    }
+
+    SerialTransaction(const uint8_t *cmd, int cmdLen, bool expectResponse = true): m_expectResponse(expectResponse),
+            m_responseLen(0), m_result(false), m_done(false), m_callback(NULL), m_context(NULL) {
+        if (cmdLen > SERIAL_MAX_FRAME_LEN) cmdLen = SERIAL_MAX_FRAME_LEN;
+        memcpy(m_cmd, cmd, cmdLen);
+        m_cmdLen = cmdLen;
+    }
+
+    uint8_t getOpcode() const {
+        return m_cmd[4] & 0x1f;
+    }
+
+    uint8_t getAxis() const {
+        return m_cmd[4] >> 5;
+    }
+
+    SerialOp getOp() const {
+        if (m_cmdLen < 5) return SERIAL_OP_OTHER;
+        if (m_cmdLen == 5 && (m_cmd[4] == 0x00 || m_cmd[4] == 0xff)) return SERIAL_OP_ENABLE;
+
+        switch (getOpcode()) {
+            case 0x01: return SERIAL_OP_SLEW;
+            case 0x02: return SERIAL_OP_GOTO;
+            case 0x04: return SERIAL_OP_INQUIRY;
+            case 0x0f: return SERIAL_OP_0F;
+            case 0x10: return SERIAL_OP_10;
+            default: return SERIAL_OP_OTHER;
+        }
+    }
+};
+
+/*
+ * Owns the serial port. Transactions are queued from any thread and written by the I/O thread, which keeps up
+ * to m_maxInFlight frames outstanding on the wire. Frames queued together go out with a single write(). The
+ * mount answers in order and echoes the opcode byte, so a response belongs to the oldest in-flight transaction
+ * with that opcode, and the ones before it have lost theirs. Completion is signalled through the transaction's
+ * callback if it has one, otherwise through the waiter in execute().
+ *
+ * If the device fails, e.g. because the USB adapter reset, everything pending fails and the I/O thread reopens the
+ * same path with backoff. Transactions submitted meanwhile fail right away.
+ */
+class SerialLink {
+public:
+    typedef void (*ReconnectCallback)(void *context);
+
+private:
+    static const int RESPONSE_TIMEOUT = -1;
+    static const int PORT_FAILED = -2;
+
+    FileDescriptor m_fd;
+    char m_devPath[PATH_MAX];
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_queueCond;
+    pthread_cond_t m_doneCond;
+    int m_threadCreateStatus;
+    int m_syncCreateStatus;
+    bool m_stopRequested;
+    bool m_connected;
+    int m_maxInFlight;
+    ReconnectCallback m_reconnectCallback;
+    void *m_reconnectContext;
+
+    SerialTransaction *m_queue[SERIAL_QUEUE_SIZE];
+    unsigned m_queueHead;
+    unsigned m_queueTail;
+
+    SerialTransaction *m_inFlight[SERIAL_MAX_IN_FLIGHT];
+    unsigned m_inFlightHead;
+    unsigned m_inFlightTail;
+
+    SerialStats m_stats;
+    SerialRecorder *m_recorder;
+    uint8_t m_writeBuffer[SERIAL_MAX_IN_FLIGHT * SERIAL_MAX_FRAME_LEN]; // I/O thread only
+
+    // Receive state, I/O thread only
+    RingBuffer<SERIAL_RX_BUFFER_SIZE> m_rx;
+    int64_t m_rxStartTime;    // When the byte at the front of m_rx arrived
+    int64_t m_lastReadTime;
+    int64_t m_lastResponseTime;
+
+public:
+    SerialLink(): m_threadCreateStatus(-1), m_syncCreateStatus(-1), m_stopRequested(false), m_connected(false),
+            m_maxInFlight(SERIAL_DEFAULT_MAX_IN_FLIGHT), m_reconnectCallback(NULL), m_reconnectContext(NULL),
+            m_queueHead(0), m_queueTail(0), m_inFlightHead(0), m_inFlightTail(0), m_recorder(NULL), m_rxStartTime(0),
+            m_lastReadTime(0), m_lastResponseTime(0) {
+    }
+
+    ~SerialLink() {
+        close();
+
+        if (m_syncCreateStatus == 0) {
+            pthread_cond_destroy(&m_doneCond);
+            pthread_cond_destroy(&m_queueCond);
+            pthread_mutex_destroy(&m_mutex);
+        }
+    }
+
+    bool open(const char *devPath) {
+        snprintf(m_devPath, sizeof(m_devPath), "%s", devPath);
+        if (!openDevice()) return false;
+
+        if (m_syncCreateStatus != 0) {
+            m_syncCreateStatus = pthread_mutex_init(&m_mutex, NULL);
+            if (m_syncCreateStatus != 0) goto err;
+
+            pthread_cond_init(&m_queueCond, NULL);
+            pthread_cond_init(&m_doneCond, NULL);
+        }
+
+        m_stopRequested = false;
+        m_connected = true;
+        m_threadCreateStatus = pthread_create(&m_thread, NULL, threadProc, this);
+
+        if (m_threadCreateStatus == 0) {
+            return true;
+        }
+    err:
+        m_fd.close();
+        return false;
+    }
+
+    void close() {
+        if (m_threadCreateStatus == 0) {
+            lock();
+            __atomic_store_n(&m_stopRequested, true, __ATOMIC_RELEASE); // Read without the mutex while reopening
+            pthread_cond_signal(&m_queueCond);
+            unlock();
+
+            pthread_join(m_thread, NULL);
+            m_threadCreateStatus = -1;
+        }
+
+        if (m_fd != -1) {
+            m_fd.close();
+        }
+    }
+
+    void setMaxInFlight(int maxInFlight) {
+        if (maxInFlight < 1) {
+            maxInFlight = 1;
+        } else if (maxInFlight > SERIAL_MAX_IN_FLIGHT) {
+            maxInFlight = SERIAL_MAX_IN_FLIGHT;
+        }
+
+        lock();
+        m_maxInFlight = maxInFlight;
+        pthread_cond_signal(&m_queueCond);
+        unlock();
+    }
+
+    /* Call before open, all traffic is then recorded by the I/O thread */
+    void setRecorder(SerialRecorder *recorder) {
+        m_recorder = recorder;
+    }
+
+    /* False while the device is lost and being reopened */
+    bool isConnected() const {
+        return __atomic_load_n(&m_connected, __ATOMIC_ACQUIRE);
+    }
+
+    /* Call before open, the callback runs on the I/O thread each time the device has been reopened */
+    void setReconnectCallback(ReconnectCallback callback, void *context) {
+        m_reconnectCallback = callback;
+        m_reconnectContext = context;
+    }
+
+    /* Counters are updated with relaxed atomics, safe to read at any time */
+    const SerialStats& getStats() const {
+        return m_stats;
+    }
+
+    /* Queues transaction, blocks only while the queue is full. Transaction must stay valid until completed. */
+    bool submit(SerialTransaction *tx) {
+        if (!lock()) return false;
+        bool result = enqueue(tx);
+        unlock();
+        return result;
+    }
+
+    /* Queues transaction and waits for its completion */
+    bool execute(SerialTransaction *tx) {
+        tx->m_callback = NULL;
+        if (!lock()) return false;
+
+        if (enqueue(tx)) {
+            while (!tx->m_done) {
+                wait(&m_doneCond);
+            }
+        }
+
+        unlock();
+        return tx->m_result;
+    }
+
+    /* Queues transactions so that they are written together, waits for all of them and returns if all succeeded */
+    bool executeBatch(SerialTransaction *const *txs, int count) {
+        int numQueued = 0;
+        bool result = true;
+
+        if (!lock()) return false;
+
+        for (; numQueued < count; numQueued++) {
+            txs[numQueued]->m_callback = NULL;
+            if (!enqueue(txs[numQueued])) break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            while (i < numQueued && !txs[i]->m_done) {
+                wait(&m_doneCond);
+            }
+
+            if (!txs[i]->m_result) result = false;
+        }
+
+        unlock();
+        return result;
+    }
+
+private:
+    static void *threadProc(void *arg) {
+        ((SerialLink *) arg)->loop();
+        return NULL;
+    }
+
+    /* Opens m_devPath in raw mode */
+    bool openDevice() {
+        int dev = ::open(m_devPath, O_RDWR | O_NOCTTY);
+        if (dev == -1) return false;
+        m_fd.set(dev);
+
+        termios params;
+        if (tcgetattr(dev, &params) == -1) goto err;
+
+        cfmakeraw(&params);
+        cfsetispeed(&params, B9600);
+        cfsetospeed(&params, B9600);
+        params.c_cflag = CS8 | CREAD | CLOCAL;
+        params.c_cc[VTIME] = 0; // Reads never block, the I/O thread waits in poll() with its own deadlines
+        params.c_cc[VMIN] = 0;
+        if (tcsetattr(dev, TCSANOW, &params) == -1) goto err;
+
+        m_rx.clear();
+        return true;
+    err:
+        m_fd.close();
+        return false;
+    }
+
+    /* Mutex hold times go to the trace, condition waits don't count as holding it */
+    bool lock() {
+        if (pthread_mutex_lock(&m_mutex) != 0) return false;
+        traceBegin(TRACE_SERIAL_MUTEX);
+        return true;
+    }
+
+    void unlock() {
+        traceEnd(TRACE_SERIAL_MUTEX);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void wait(pthread_cond_t *cond) {
+        traceEnd(TRACE_SERIAL_MUTEX);
+        pthread_cond_wait(cond, &m_mutex);
+        traceBegin(TRACE_SERIAL_MUTEX);
+    }
+
+    /* Must be called with mutex held */
+    bool enqueue(SerialTransaction *tx) {
+        tx->m_done = false;
+        tx->m_result = false;
+        tx->m_responseLen = 0;
+        tx->m_submitTime = monotonicNs();
+        tx->m_writeStart = 0;
+        tx->m_writeEnd = 0;
+        tx->m_firstByteTime = 0;
+
+        while (m_queueTail - m_queueHead == SERIAL_QUEUE_SIZE && !m_stopRequested && m_connected) {
+            wait(&m_doneCond);
+        }
+
+        if (m_stopRequested || !m_connected) return false;
+
+        m_queue[m_queueTail++ % SERIAL_QUEUE_SIZE] = tx;
+        pthread_cond_signal(&m_queueCond);
+        return true;
+    }
+
+    /* Must be called with mutex held, may temporarily release it to run the callback */
+    void complete(SerialTransaction *tx, bool result) {
+        tx->m_result = result;
+        recordStats(tx, monotonicNs());
+
+        if (tx->m_callback != NULL) {
+            tx->m_done = true;
+            unlock();
+            tx->m_callback(tx, tx->m_context);
+            lock();
+        } else {
+            tx->m_done = true; // Waiter may release tx as soon as it sees this
+        }
+
+        pthread_cond_broadcast(&m_doneCond);
+    }
+
+    void recordStats(const SerialTransaction *tx, int64_t now) {
+        uint8_t axis = tx->getAxis();
+        SerialOpStats &stats = m_stats.m_ops[tx->getOp()][axis < 2 ? axis : 0];
+
+        __atomic_fetch_add(&stats.m_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.m_bytesRead, tx->m_responseLen, __ATOMIC_RELAXED);
+
+        if (!tx->m_result) {
+            __atomic_fetch_add(&stats.m_failures, 1, __ATOMIC_RELAXED);
+        }
+
+        if (tx->m_writeStart == 0) return; // Never written
+
+        __atomic_fetch_add(&stats.m_bytesWritten, tx->m_cmdLen, __ATOMIC_RELAXED);
+        stats.m_queueWait.recordNs(tx->m_writeStart - tx->m_submitTime);
+        stats.m_writeTime.recordNs(tx->m_writeEnd - tx->m_writeStart);
+
+        if (tx->m_result && tx->m_expectResponse) {
+            stats.m_firstByte.recordNs(tx->m_firstByteTime - tx->m_writeEnd);
+            stats.m_roundTrip.recordNs(now - tx->m_writeStart);
+        }
+    }
+
+    void failInFlight() {
+        while (m_inFlightHead != m_inFlightTail) {
+            complete(m_inFlight[m_inFlightHead++ % SERIAL_MAX_IN_FLIGHT], false);
+        }
+
+        tcflush(m_fd, TCIFLUSH);
+        m_rx.clear();
+    }
+
+    void failQueued() {
+        while (m_queueHead != m_queueTail) {
+            complete(m_queue[m_queueHead++ % SERIAL_QUEUE_SIZE], false);
+        }
+    }
+
+    /* Must be called with mutex held, returns with it held once the device is back or the link is closed */
+    void reconnect() {
+        int64_t lostTime = monotonicNs();
+        fprintf(stderr, "Serial device lost, reopening %s\n", m_devPath);
+        if (m_recorder != NULL) m_recorder->record(RECORD_DEVICE_LOST, m_devPath, strlen(m_devPath), lostTime);
+
+        __atomic_store_n(&m_connected, false, __ATOMIC_RELEASE); // Before failing, so that callers see it
+        failInFlight();
+        failQueued();
+        unlock();
+
+        m_fd.close();
+        bool reopened = reopen();
+
+        lock();
+        if (!reopened) return;
+
+        __atomic_store_n(&m_connected, true, __ATOMIC_RELEASE);
+        m_lastResponseTime = 0;
+        __atomic_fetch_add(&m_stats.m_reconnects, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Serial device reopened after %lld ms\n", (long long) ((monotonicNs() - lostTime) / NS_PER_MS));
+
+        if (m_reconnectCallback != NULL) {
+            unlock();
+            m_reconnectCallback(m_reconnectContext);
+            lock();
+        }
+    }
+
+    /*
+     * Retries opening the device until it works or the link is closed. Changes in the directory of the path wake
+     * it early, that's where udev recreates the device node and its symlinks when the adapter comes back.
+     */
+    bool reopen() {
+        int64_t delay = SERIAL_REOPEN_MIN_DELAY_MS * NS_PER_MS;
+        FileDescriptor watch(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+        char dir[PATH_MAX];
+
+        snprintf(dir, sizeof(dir), "%s", m_devPath);
+        char *slash = strrchr(dir, '/');
+
+        if (slash == NULL) {
+            strcpy(dir, ".");
+        } else {
+            slash[slash == dir ? 1 : 0] = 0;
+        }
+
+        if (watch != -1 && inotify_add_watch(watch, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) == -1) {
+            watch.close(); // No directory to watch, e.g. /dev/serial/by-id goes away with the last adapter
+        }
+
+        while (!__atomic_load_n(&m_stopRequested, __ATOMIC_ACQUIRE)) {
+            if (openDevice()) return true;
+
+            pollfd pfd = { watch, POLLIN, 0 };
+            timespec timeoutSpec = { (time_t) (delay / NS_PER_SEC), (long) (delay % NS_PER_SEC) };
+
+            if (ppoll(&pfd, watch != -1 ? 1 : 0, &timeoutSpec, NULL) > 0) {
+                uint8_t events[1024] __attribute__((aligned(8)));
+                while (watch.read(events, sizeof(events)) > 0);
+            } else if (delay < SERIAL_REOPEN_MAX_DELAY_MS * NS_PER_MS) {
+                delay *= 2;
+                if (delay > SERIAL_REOPEN_MAX_DELAY_MS * NS_PER_MS) delay = SERIAL_REOPEN_MAX_DELAY_MS * NS_PER_MS;
+            }
+        }
+
+        return false;
+    }
+
+    void loop() {
+        traceThreadName("serial");
+        lock();
+
+        while (!m_stopRequested) {
+            if (m_queueHead == m_queueTail && m_inFlightHead == m_inFlightTail) {
+                wait(&m_queueCond);
+                continue;
+            }
+
+            // Keep the wire busy: write all queued frames up to the in-flight limit at once
+            SerialTransaction *batch[SERIAL_MAX_IN_FLIGHT];
+            int numBatched = 0;
+            int batchLen = 0;
+
+            while (m_queueHead != m_queueTail && (int) (m_inFlightTail - m_inFlightHead) + numBatched < m_maxInFlight) {
+                SerialTransaction *tx = m_queue[m_queueHead++ % SERIAL_QUEUE_SIZE];
+                memcpy(m_writeBuffer + batchLen, tx->m_cmd, tx->m_cmdLen);
+                batchLen += tx->m_cmdLen;
+                batch[numBatched++] = tx;
+            }
+
+            if (numBatched != 0) {
+                pthread_cond_broadcast(&m_doneCond); // Queue has room again
+
+                unlock();
+                traceBegin(TRACE_SERIAL_WRITE, numBatched);
+                int64_t writeStart = monotonicNs();
+                bool written = m_fd.writeFully(m_writeBuffer, batchLen);
+                int64_t writeEnd = monotonicNs();
+                traceEnd(TRACE_SERIAL_WRITE, numBatched);
+
+                for (int i = 0; i < numBatched; i++) {
+                    SerialTransaction *tx = batch[i];
+                    tx->m_writeStart = writeStart;
+                    tx->m_writeEnd = writeEnd;
+                    if (m_recorder != NULL && written) m_recorder->record(RECORD_TX, tx->m_cmd, tx->m_cmdLen, writeStart);
+                }
+
+                lock();
+
+                if (!written) fprintf(stderr, "Serial write failed: %d\n", errno);
+
+                for (int i = 0; i < numBatched; i++) {
+                    SerialTransaction *tx = batch[i];
+
+                    if (!written) {
+                        complete(tx, false);
+                    } else if (!tx->m_expectResponse) {
+                        complete(tx, true);
+                    } else {
+                        m_inFlight[m_inFlightTail++ % SERIAL_MAX_IN_FLIGHT] = tx;
+                    }
+                }
+
+                if (!written) {
+                    reconnect();
+                    continue;
+                }
+            }
+
+            if (m_inFlightHead != m_inFlightTail) {
+                SerialTransaction *tx = m_inFlight[m_inFlightHead % SERIAL_MAX_IN_FLIGHT];
+                int64_t start = tx->m_writeEnd > m_lastResponseTime ? tx->m_writeEnd : m_lastResponseTime;
+
+                unlock();
+                traceBegin(TRACE_SERIAL_READ, tx->m_cmd[4]);
+                int answered = receiveResponse(start + SERIAL_RESPONSE_TIMEOUT_MS * NS_PER_MS);
+                traceEnd(TRACE_SERIAL_READ, tx->m_cmd[4]);
+                lock();
+
+                if (answered == PORT_FAILED) {
+                    reconnect();
+                } else if (answered == RESPONSE_TIMEOUT) {
+                    // Only this one is given up, the frames behind it get a deadline of their own
+                    fprintf(stderr, "Serial response timeout, opcode %02X\n", tx->m_cmd[4]);
+                    m_lastResponseTime = monotonicNs();
+                    m_inFlightHead++;
+                    complete(tx, false);
+                } else {
+                    for (int i = 0; i < answered; i++) {
+                        complete(m_inFlight[m_inFlightHead++ % SERIAL_MAX_IN_FLIGHT], false);
+                    }
+
+                    complete(m_inFlight[m_inFlightHead++ % SERIAL_MAX_IN_FLIGHT], true);
+                }
+            }
+        }
+
+        failInFlight();
+        failQueued();
+        unlock();
+    }
+
+    /*
+     * Waits until the response of an in-flight transaction is complete and stores it there. Returns how far that
+     * transaction is from the in-flight head, RESPONSE_TIMEOUT if the deadline passed first or PORT_FAILED. Bytes before a sync header and
+     * responses matching no in-flight frame are dropped on the way, so the stream realigns in one pass.
+     */
+    int receiveResponse(int64_t deadline) {
+        while (true) {
+            int answered = parseResponse();
+            if (answered != -1) return answered;
+
+            int64_t timeout = deadline - monotonicNs();
+
+            if (timeout <= 0) {
+                // Whatever frame is at the front won't be completed, scan for the next header from here
+                if (m_rx.size() != 0) discard(1);
+                return RESPONSE_TIMEOUT;
+            }
+
+            pollfd pfd = { m_fd, POLLIN, 0 };
+            timespec timeoutSpec = { (time_t) (timeout / NS_PER_SEC), (long) (timeout % NS_PER_SEC) };
+            int pollResult = ppoll(&pfd, 1, &timeoutSpec, NULL);
+
+            if (pollResult == -1 && errno != EINTR) {
+                fprintf(stderr, "Serial poll failed: %d\n", errno);
+                return PORT_FAILED;
+            }
+
+            if (pollResult > 0 && !receive()) return PORT_FAILED;
+        }
+    }
+
+    /* Appends what the port has to m_rx */
+    bool receive() {
+        bool wasEmpty = m_rx.size() == 0;
+        ssize_t numRead = m_rx.readFrom(m_fd);
+
+        if (numRead == -1) {
+            if (errno == EAGAIN || errno == EINTR) return true;
+            fprintf(stderr, "Serial read failed: %d\n", errno);
+            return false;
+        }
+
+        if (numRead == 0) {
+            // Readable but nothing to read, the device is gone
+            fputs("Serial port closed\n", stderr);
+            return false;
+        }
+
+        m_lastReadTime = monotonicNs();
+        if (wasEmpty) m_rxStartTime = m_lastReadTime;
+
+        if (m_recorder != NULL) {
+            uint8_t data[SERIAL_RX_BUFFER_SIZE];
+
+            for (ssize_t i = 0; i < numRead; i++) {
+                data[i] = m_rx[m_rx.size() - numRead + i];
+            }
+
+            m_recorder->record(RECORD_RX, data, numRead, m_lastReadTime);
+        }
+
+        return true;
+    }
+
+    /* Takes the first complete response out of m_rx, returns its transaction's offset from the in-flight head */
+    int parseResponse() {
+        while (m_rx.size() >= 5) {
+            unsigned frameLen = m_rx[3] + 4;
+
+            if (m_rx[0] != 0x55 || m_rx[1] != 0xaa || m_rx[2] != 0x01 || frameLen < 5
+                    || frameLen > SERIAL_MAX_FRAME_LEN) {
+                discard(1);
+                continue;
+            }
+
+            if (m_rx.size() < frameLen) return -1;
+
+            int inFlight = m_inFlightTail - m_inFlightHead;
+
+            for (int i = 0; i < inFlight; i++) {
+                SerialTransaction *tx = m_inFlight[(m_inFlightHead + i) % SERIAL_MAX_IN_FLIGHT];
+                if (tx->m_cmd[4] != m_rx[4]) continue;
+
+                tx->m_responseLen = m_rx.peek(tx->m_response, frameLen);
+                tx->m_firstByteTime = m_rxStartTime;
+                m_lastResponseTime = m_lastReadTime;
+                m_rx.consume(frameLen);
+                m_rxStartTime = m_lastReadTime; // Anything left came with the last read
+                return i;
+            }
+
+            discard(frameLen); // Late response to a transaction that already timed out
+        }
+
+        return -1;
+    }
+
+    void discard(unsigned len) {
+        m_rx.consume(len);
+        m_rxStartTime = m_lastReadTime;
+        __atomic_fetch_add(&m_stats.m_discardedBytes, len, __ATOMIC_RELAXED);
+    }
+};
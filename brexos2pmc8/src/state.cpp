@@ -0,0 +1,181 @@
+#pragma once
+#include <cstdio>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATE_MAGIC "BR2STAT"
+#define STATE_VERSION 1
+
+/* What a restarted bridge needs to carry on where the previous one left off */
+struct SessionStateData {
+    uint32_t m_sequence;          // Incremented by every update
+    int32_t m_syncOffsets[2];     // PMC8 counts minus converted mount counts, set by ESSp
+    int32_t m_trackingRates[2];   // Mount rate units, 0 if not tracking
+    uint8_t m_directions[2];      // Last ESSd direction of each axis
+    uint8_t m_reserved[2];
+    uint32_t m_checksum;          // FNV-1a of the fields above
+};
+
+struct SessionStateFile {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_slotSize;
+    SessionStateData m_slots[2];  // Written in turn, so a torn update leaves the other one intact
+};
+
+/*
+ * Session state kept in a small memory mapped file. Updates write the older of the two slots, the valid one with
+ * the higher sequence is current. Like with SerialRecorder the kernel writes the pages back, so an update is a
+ * memcpy into the mapping that survives the process, and the checksum catches a page written back halfway.
+ * The PMC8 server and the manager thread both update it under the mutex.
+ */
+class SessionState {
+    SessionStateFile *m_file;
+    SessionStateData m_current;
+    bool m_restored;
+    pthread_mutex_t m_mutex;
+
+public:
+    SessionState(): m_file(NULL), m_restored(false) {
+        memset(&m_current, 0, sizeof(m_current));
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~SessionState() {
+        if (m_file != NULL) munmap(m_file, sizeof(SessionStateFile));
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    /* Maps the file, creating it if needed. A missing, foreign or corrupt file is reset to the empty state. */
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+            fprintf(stderr, "Cannot open state %s: %d\n", path, errno);
+            return false;
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) == -1 || (st.st_size < (off_t) sizeof(SessionStateFile)
+                && ftruncate(fd, sizeof(SessionStateFile)) == -1)) {
+            fprintf(stderr, "Cannot size state %s: %d\n", path, errno);
+            ::close(fd);
+            return false;
+        }
+
+        void *map = mmap(NULL, sizeof(SessionStateFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Cannot map state %s: %d\n", path, errno);
+            return false;
+        }
+
+        m_file = (SessionStateFile *) map;
+
+        if (memcmp(m_file->m_magic, STATE_MAGIC, sizeof(m_file->m_magic)) == 0
+                && m_file->m_version == STATE_VERSION && m_file->m_slotSize == sizeof(SessionStateData)) {
+            const SessionStateData *slot = NULL;
+
+            for (int i = 0; i < 2; i++) {
+                const SessionStateData &candidate = m_file->m_slots[i];
+                if (candidate.m_checksum != checksum(candidate)) continue;
+
+                if (slot == NULL || (int32_t) (candidate.m_sequence - slot->m_sequence) > 0) slot = &candidate;
+            }
+
+            if (slot != NULL) {
+                m_current = *slot;
+                m_restored = true;
+                return true;
+            }
+
+            fprintf(stderr, "State %s is corrupt, starting afresh\n", path);
+        }
+
+        memset(m_file, 0, sizeof(SessionStateFile));
+        memcpy(m_file->m_magic, STATE_MAGIC, sizeof(m_file->m_magic));
+        m_file->m_version = STATE_VERSION;
+        m_file->m_slotSize = sizeof(SessionStateData);
+        write();
+        return true;
+    }
+
+    /* True if open() found the state of a previous run */
+    bool isRestored() const {
+        return m_restored;
+    }
+
+    int syncOffset(int axis) {
+        return current().m_syncOffsets[axis];
+    }
+
+    int trackingRate(int axis) {
+        return current().m_trackingRates[axis];
+    }
+
+    unsigned direction(int axis) {
+        return current().m_directions[axis];
+    }
+
+    void setSyncOffset(int axis, int offset) {
+        update(&SessionStateData::m_syncOffsets, axis, offset);
+    }
+
+    void setTrackingRate(int axis, int rate) {
+        update(&SessionStateData::m_trackingRates, axis, rate);
+    }
+
+    void setDirection(int axis, unsigned direction) {
+        update(&SessionStateData::m_directions, axis, (uint8_t) direction);
+    }
+
+private:
+    SessionStateData current() {
+        pthread_mutex_lock(&m_mutex);
+        SessionStateData data = m_current;
+        pthread_mutex_unlock(&m_mutex);
+        return data;
+    }
+
+    /* Writes only what changed, guide pulses set the same direction over and over */
+    template <typename T>
+    void update(T (SessionStateData::*field)[2], int axis, T value) {
+        pthread_mutex_lock(&m_mutex);
+
+        if ((m_current.*field)[axis] != value) {
+            (m_current.*field)[axis] = value;
+            write();
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /* Must be called with mutex held */
+    void write() {
+        if (m_file == NULL) return;
+
+        m_current.m_sequence++;
+        m_current.m_checksum = checksum(m_current);
+        m_file->m_slots[m_current.m_sequence & 1] = m_current;
+    }
+
+    static uint32_t checksum(const SessionStateData &data) {
+        const uint8_t *bytes = (const uint8_t *) &data;
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < offsetof(SessionStateData, m_checksum); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+
+        return hash;
+    }
+};
@@ -0,0 +1,300 @@
+#pragma once
+#include <cstdio>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <new>
+#include "clock.cpp"
+
+#define TRACE_RING_SIZE 16384  // Events per thread, a power of 2
+#define TRACE_MAX_THREADS 16
+#define TRACE_MAX_NAME_LEN 24
+
+enum TraceEventType {
+    TRACE_PMC8_COMMAND,  // Arg: command characters between "ES" and "!"
+    TRACE_SERIAL_MUTEX,
+    TRACE_SERIAL_WRITE,  // Arg: frames written at once
+    TRACE_SERIAL_READ,   // Arg: opcode byte
+    TRACE_TICK,
+    TRACE_GOTO_RAMP,     // Arg: rate
+    TRACE_SLEW_RAMP,     // Arg: rate
+    TRACE_POWER_SAVE,
+    TRACE_EVENT_COUNT
+};
+
+static const char *const traceEventNames[TRACE_EVENT_COUNT] = {
+    "pmc8 command", "serial mutex", "serial write", "serial read", "tick", "goto ramp", "slew ramp", "power save"
+};
+
+// Name of the event's argument in the trace, NULL if it has none
+static const char *const traceArgNames[TRACE_EVENT_COUNT] = {
+    "command", NULL, "frames", "opcode", NULL, "rate", "rate", NULL
+};
+
+/* Chrome trace phases */
+enum TracePhase {
+    TRACE_BEGIN = 'B',
+    TRACE_END = 'E',
+    TRACE_INSTANT = 'i'
+};
+
+struct TraceEvent {
+    int64_t m_time; // CLOCK_MONOTONIC ns
+    uint8_t m_type;
+    uint8_t m_phase;
+    uint16_t m_reserved;
+    int32_t m_arg;
+};
+
+/*
+ * Ring of the most recent events of one thread. Only the owning thread writes, so recording is a clock read and
+ * a few relaxed stores. Readers copy the ring word by word and drop the slots the writer may have overwritten
+ * meanwhile, like SeqLock does for a single value.
+ */
+class TraceRing {
+    static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "Trace ring size must be a power of 2");
+    static_assert(sizeof(TraceEvent) % sizeof(uint32_t) == 0, "Trace event size must be a multiple of 4");
+
+    static const unsigned WORDS_PER_EVENT = sizeof(TraceEvent) / sizeof(uint32_t);
+
+    char m_name[TRACE_MAX_NAME_LEN];
+    int m_tid;
+    uint32_t m_head;
+    uint32_t m_words[TRACE_RING_SIZE * WORDS_PER_EVENT];
+
+public:
+    TraceRing(int tid): m_tid(tid), m_head(0) {
+        snprintf(m_name, sizeof(m_name), "thread %d", tid);
+    }
+
+    void setName(const char *name) {
+        snprintf(m_name, sizeof(m_name), "%s", name);
+    }
+
+    const char *name() const {
+        return m_name;
+    }
+
+    int tid() const {
+        return m_tid;
+    }
+
+    /* Owning thread only */
+    void add(uint8_t type, uint8_t phase, int32_t arg) {
+        TraceEvent event = { monotonicNs(), type, phase, 0, arg };
+        uint32_t src[WORDS_PER_EVENT];
+        memcpy(src, &event, sizeof(src));
+        uint32_t head = m_head;
+        uint32_t *dst = m_words + (head & (TRACE_RING_SIZE - 1)) * WORDS_PER_EVENT;
+
+        for (unsigned i = 0; i < WORDS_PER_EVENT; i++) {
+            __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    /* Any thread, copies the events still intact in recorded order and returns their number */
+    unsigned snapshot(TraceEvent *events) const {
+        uint32_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        uint32_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        for (uint32_t i = start; i != head; i++) {
+            const uint32_t *src = m_words + (i & (TRACE_RING_SIZE - 1)) * WORDS_PER_EVENT;
+            uint32_t dst[WORDS_PER_EVENT];
+
+            for (unsigned word = 0; word < WORDS_PER_EVENT; word++) {
+                dst[word] = __atomic_load_n(&src[word], __ATOMIC_RELAXED);
+            }
+
+            memcpy(&events[i - start], dst, sizeof(dst));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Slots from start up to the one being written now may have been overwritten while copying
+        uint32_t headAfter = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        uint32_t firstIntact = headAfter + 1 > TRACE_RING_SIZE ? headAfter + 1 - TRACE_RING_SIZE : 0;
+        uint32_t skip = firstIntact > start ? firstIntact - start : 0;
+        uint32_t count = head - start;
+        if (skip > count) skip = count;
+
+        memmove(events, events + skip, (count - skip) * sizeof(TraceEvent));
+        return count - skip;
+    }
+};
+
+static TraceRing *traceRings[TRACE_MAX_THREADS];
+static int traceNumRings;
+static __thread TraceRing *traceThreadRing;
+static __thread bool traceThreadRegistered;
+
+/* Ring of the calling thread, registered on first use, NULL if there are too many threads */
+static TraceRing *traceRing() {
+    if (traceThreadRegistered) return traceThreadRing;
+    traceThreadRegistered = true;
+
+    int index = __atomic_fetch_add(&traceNumRings, 1, __ATOMIC_RELAXED);
+    if (index >= TRACE_MAX_THREADS) return NULL;
+
+    void *memory = malloc(sizeof(TraceRing));
+    if (memory == NULL) return NULL;
+
+    traceThreadRing = new (memory) TraceRing(index + 1);
+    __atomic_store_n(&traceRings[index], traceThreadRing, __ATOMIC_RELEASE);
+    return traceThreadRing;
+}
+
+static void traceThreadName(const char *name) {
+    TraceRing *ring = traceRing();
+    if (ring != NULL) ring->setName(name);
+}
+
+static inline void traceEvent(uint8_t type, uint8_t phase, int32_t arg) {
+    TraceRing *ring = traceRing();
+    if (ring != NULL) ring->add(type, phase, arg);
+}
+
+static inline void traceBegin(uint8_t type, int32_t arg = 0) {
+    traceEvent(type, TRACE_BEGIN, arg);
+}
+
+static inline void traceEnd(uint8_t type, int32_t arg = 0) {
+    traceEvent(type, TRACE_END, arg);
+}
+
+static inline void traceInstant(uint8_t type, int32_t arg = 0) {
+    traceEvent(type, TRACE_INSTANT, arg);
+}
+
+/* Packs up to 4 characters into an event argument */
+static inline int32_t traceText(const char *text, int len) {
+    uint32_t arg = 0;
+
+    for (int i = 0; i < 4 && i < len; i++) {
+        arg |= (uint32_t) (uint8_t) text[i] << (i * 8);
+    }
+
+    return arg;
+}
+
+/* Writes the events of all threads as Chrome trace JSON, loadable in chrome://tracing and Perfetto */
+static bool traceWriteJson(FILE *out) {
+    TraceEvent *events = (TraceEvent *) malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+    if (events == NULL) return false;
+
+    int numRings = __atomic_load_n(&traceNumRings, __ATOMIC_RELAXED);
+    if (numRings > TRACE_MAX_THREADS) numRings = TRACE_MAX_THREADS;
+    const char *separator = "";
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+
+    for (int index = 0; index < numRings; index++) {
+        const TraceRing *ring = __atomic_load_n(&traceRings[index], __ATOMIC_ACQUIRE);
+        if (ring == NULL) continue;
+
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, ring->tid(), ring->name());
+        separator = ",";
+
+        unsigned count = ring->snapshot(events);
+
+        for (unsigned i = 0; i < count; i++) {
+            const TraceEvent &event = events[i];
+            if (event.m_type >= TRACE_EVENT_COUNT) continue;
+
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03d,\"pid\":1,\"tid\":%d",
+                    traceEventNames[event.m_type], event.m_phase, (long long) (event.m_time / 1000),
+                    (int) (event.m_time % 1000), ring->tid());
+
+            if (event.m_phase == TRACE_INSTANT) fputs(",\"s\":\"t\"", out);
+
+            // Chrome merges the arguments of begin and end events, the begin ones are enough
+            const char *argName = event.m_phase != TRACE_END ? traceArgNames[event.m_type] : NULL;
+
+            if (argName == NULL) {
+                fputs("}", out);
+            } else if (event.m_type == TRACE_PMC8_COMMAND) {
+                char text[5] = {};
+
+                for (int c = 0; c < 4; c++) {
+                    char ch = (char) (event.m_arg >> (c * 8));
+                    if (ch == 0) break;
+                    text[c] = ch >= ' ' && ch <= '~' && ch != '"' && ch != '\\' ? ch : '?';
+                }
+
+                fprintf(out, ",\"args\":{\"%s\":\"%s\"}}", argName, text);
+            } else {
+                fprintf(out, ",\"args\":{\"%s\":%d}}", argName, event.m_arg);
+            }
+        }
+    }
+
+    fputs("\n]}\n", out);
+    free(events);
+    return !ferror(out);
+}
+
+/*
+ * Writes the trace to a file whenever the process receives SIGUSR1. The signal is taken by sigwait() on a thread
+ * of its own, so formatting happens outside of signal context. start() must be called before any other thread is
+ * created, so that they all inherit the blocked signal.
+ */
+class TraceDumper {
+    const char *m_path;
+    sigset_t m_signals;
+    pthread_t m_thread;
+    int m_threadCreateStatus;
+
+public:
+    TraceDumper(): m_path(NULL), m_threadCreateStatus(-1) {
+    }
+
+    ~TraceDumper() {
+        if (m_threadCreateStatus == 0) {
+            pthread_cancel(m_thread);
+            pthread_join(m_thread, NULL);
+        }
+    }
+
+    bool start(const char *path) {
+        m_path = path;
+        sigemptyset(&m_signals);
+        sigaddset(&m_signals, SIGUSR1);
+
+        if (pthread_sigmask(SIG_BLOCK, &m_signals, NULL) != 0) return false;
+
+        m_threadCreateStatus = pthread_create(&m_thread, NULL, threadProc, this);
+        return m_threadCreateStatus == 0;
+    }
+
+private:
+    static void *threadProc(void *arg) {
+        ((TraceDumper *) arg)->loop();
+        return NULL;
+    }
+
+    void loop() {
+        traceThreadName("trace dump");
+
+        while (true) {
+            int signal;
+            if (sigwait(&m_signals, &signal) != 0) continue;
+
+            FILE *out = fopen(m_path, "w");
+
+            if (out == NULL) {
+                fprintf(stderr, "Cannot create trace %s: %d\n", m_path, errno);
+                continue;
+            }
+
+            bool result = traceWriteJson(out);
+            if (fclose(out) != 0) result = false;
+
+            fprintf(stderr, result ? "Trace written to %s\n" : "Cannot write trace %s\n", m_path);
+        }
+    }
+};
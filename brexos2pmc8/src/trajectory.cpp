@@ -0,0 +1,152 @@
+#pragma once
+#include <math.h>
+
+#define TRAJECTORY_TABLE_SIZE 64
+
+/* Rate units per second, per second squared */
+struct TrajectoryLimits {
+    double m_maxRate;
+    double m_acceleration;
+    double m_jerk;
+
+    TrajectoryLimits(double maxRate, double acceleration, double jerk): m_maxRate(maxRate),
+            m_acceleration(acceleration), m_jerk(jerk) {
+    }
+
+    /* Same profile shape stretched by the factor in time, covers the same distance */
+    TrajectoryLimits stretched(double factor) const {
+        return TrajectoryLimits(m_maxRate / factor, m_acceleration / (factor * factor),
+                m_jerk / (factor * factor * factor));
+    }
+};
+
+/*
+ * Jerk limited (S-curve) goto profile. Only the ramp from standstill to the peak rate is tabulated together
+ * with the distance it covers: acceleration is sampled by elapsed time, cruise is the peak rate and
+ * deceleration mirrors the ramp, sampled by the distance still to go so that a mount running behind
+ * schedule keeps moving and one running ahead slows down in time.
+ */
+class GotoTrajectory {
+    float m_rates[TRAJECTORY_TABLE_SIZE];      // Rate at i * m_step into the ramp
+    float m_distances[TRAJECTORY_TABLE_SIZE];  // Counts covered by then
+    double m_step;
+    double m_peakRate;
+    double m_rampTime;
+    double m_duration;
+
+public:
+    GotoTrajectory(): m_step(0), m_peakRate(0), m_rampTime(0), m_duration(0) {
+    }
+
+    /* Distance in counts, countsPerRate converts a rate to counts per second */
+    void plan(const TrajectoryLimits &limits, double distance, double countsPerRate) {
+        distance = fabs(distance);
+        double peakRate = limits.m_maxRate;
+
+        if (2 * rampDistance(limits, peakRate, countsPerRate) > distance) {
+            // Not enough room to reach the max rate, ramp up and straight back down
+            double low = 0;
+            double high = peakRate;
+
+            for (int i = 0; i < 40; i++) {
+                peakRate = (low + high) / 2;
+                if (2 * rampDistance(limits, peakRate, countsPerRate) > distance) high = peakRate; else low = peakRate;
+            }
+
+            peakRate = low;
+        }
+
+        m_peakRate = peakRate;
+        m_rampTime = rampTime(limits, peakRate);
+        m_step = m_rampTime / (TRAJECTORY_TABLE_SIZE - 1);
+
+        double covered = 0;
+
+        for (int i = 0; i < TRAJECTORY_TABLE_SIZE; i++) {
+            m_rates[i] = rampRate(limits, peakRate, i * m_step);
+            if (i > 0) covered += (m_rates[i - 1] + m_rates[i]) / 2 * m_step * countsPerRate;
+            m_distances[i] = covered;
+        }
+
+        double cruise = distance - 2 * covered;
+        m_duration = 2 * m_rampTime + (cruise > 0 && peakRate > 0 ? cruise / (peakRate * countsPerRate) : 0);
+    }
+
+    /* Rate allowed at the given time since the start and distance still to go */
+    double rate(double elapsed, double remaining) const {
+        double accelRate = elapsed >= m_rampTime ? m_peakRate : sample(m_rates, elapsed / m_step);
+        double decelRate = rateForRemaining(fabs(remaining));
+        return accelRate < decelRate ? accelRate : decelRate;
+    }
+
+    /* Counts needed to stop from the peak rate */
+    double stoppingDistance() const {
+        return m_distances[TRAJECTORY_TABLE_SIZE - 1];
+    }
+
+    double rampTime() const {
+        return m_rampTime;
+    }
+
+    double duration() const {
+        return m_duration;
+    }
+
+private:
+    double rateForRemaining(double remaining) const {
+        if (remaining >= m_distances[TRAJECTORY_TABLE_SIZE - 1]) return m_peakRate;
+
+        int i = 1;
+        while (m_distances[i] < remaining) i++;
+
+        double span = m_distances[i] - m_distances[i - 1];
+        double fraction = span > 0 ? (remaining - m_distances[i - 1]) / span : 0;
+        return m_rates[i - 1] + (m_rates[i] - m_rates[i - 1]) * fraction;
+    }
+
+    static double sample(const float *table, double index) {
+        int i = (int) index;
+        if (i >= TRAJECTORY_TABLE_SIZE - 1) return table[TRAJECTORY_TABLE_SIZE - 1];
+
+        double fraction = index - i;
+        return table[i] + (table[i + 1] - table[i]) * fraction;
+    }
+
+    /* Time to get from 0 to the rate: jerk up, optional constant acceleration, jerk down */
+    static void rampPhases(const TrajectoryLimits &limits, double rate, double &jerkTime, double &accelTime) {
+        jerkTime = limits.m_acceleration / limits.m_jerk;
+
+        if (rate < limits.m_acceleration * jerkTime) {
+            jerkTime = sqrt(rate / limits.m_jerk); // Acceleration limit never reached
+            accelTime = 0;
+        } else {
+            accelTime = rate / limits.m_acceleration - jerkTime;
+        }
+    }
+
+    static double rampTime(const TrajectoryLimits &limits, double rate) {
+        double jerkTime, accelTime;
+        rampPhases(limits, rate, jerkTime, accelTime);
+        return 2 * jerkTime + accelTime;
+    }
+
+    /* Profile is point symmetric, so the average rate over the ramp is half the peak */
+    static double rampDistance(const TrajectoryLimits &limits, double rate, double countsPerRate) {
+        return rate * countsPerRate * rampTime(limits, rate) / 2;
+    }
+
+    static double rampRate(const TrajectoryLimits &limits, double rate, double t) {
+        double jerkTime, accelTime;
+        rampPhases(limits, rate, jerkTime, accelTime);
+
+        double total = 2 * jerkTime + accelTime;
+        double peakAccel = limits.m_jerk * jerkTime;
+
+        if (t >= total) return rate;
+        if (t < jerkTime) return limits.m_jerk * t * t / 2;
+        if (t < jerkTime + accelTime) return limits.m_jerk * jerkTime * jerkTime / 2 + peakAccel * (t - jerkTime);
+
+        double left = total - t;
+        return rate - limits.m_jerk * left * left / 2;
+    }
+};
@@ -1,14 +1,40 @@
+#include <cstdio>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include "mongoose.h"
+#include "clock.cpp"
+#include "metrics.cpp"
+#include "trace.cpp"
+
+#define WEBSERVER_METRICS_BUFFER_SIZE (256 * 1024)
+#define WEBSERVER_IDLE_POLL_MS 1000
+#define WEBSERVER_TELEMETRY_POLL_MS 10
+#define TELEMETRY_MAX_RATE_HZ (1000 / BREXOS2_POLL_NORMAL_MS) // Manager samples a moving axis this often
+#define TELEMETRY_DEFAULT_RATE_HZ 2
+#define TELEMETRY_MAX_BACKLOG 16384
+
+/* Per-subscriber state, kept in mg_connection::data */
+struct TelemetrySubscription {
+    int64_t m_interval;
+    int64_t m_nextSend;
+    uint32_t m_sequence[2];
+};
 
 class WebServer {
     pthread_t m_thread;
     int m_threadCreateStatus;
     mg_mgr m_mgr;
+    const Brexos2Direct& m_mount;
+    const Pmc8Server& m_pmc8Server;
+    char *m_metricsBuffer;
+    int m_numSubscribers;
 
 public:
-    WebServer(): m_threadCreateStatus(0) {
+    WebServer(const Brexos2Direct& mount, const Pmc8Server& pmc8Server): m_threadCreateStatus(-1), m_mount(mount),
+            m_pmc8Server(pmc8Server), m_numSubscribers(0) {
         mg_mgr_init(&m_mgr);
+        m_metricsBuffer = (char *) malloc(WEBSERVER_METRICS_BUFFER_SIZE);
     }
 
     ~WebServer() {
@@ -18,10 +44,13 @@ public:
         }
 
         mg_mgr_free(&m_mgr);
+        free(m_metricsBuffer);
     }
 
     bool init(const char *listenOn) {
-        mg_http_listen(&m_mgr, listenOn, eventHandler, this);
+        if (m_metricsBuffer == NULL) return false;
+        if (mg_http_listen(&m_mgr, listenOn, eventHandler, this) == NULL) return false;
+
         m_threadCreateStatus = pthread_create(&m_thread, NULL, threadProc, this);
         return m_threadCreateStatus == 0;
     }
@@ -37,11 +66,128 @@ private:
     }
 
     void loop() {
+        traceThreadName("web");
+
         while (1) {
-            mg_mgr_poll(&m_mgr, 1000);
+            mg_mgr_poll(&m_mgr, m_numSubscribers != 0 ? WEBSERVER_TELEMETRY_POLL_MS : WEBSERVER_IDLE_POLL_MS);
         }
     }
 
     void event(mg_connection *cnn, int ev, void *data) {
+        switch (ev) {
+            case MG_EV_HTTP_MSG: {
+                mg_http_message *msg = (mg_http_message *) data;
+
+                if (mg_http_match_uri(msg, "/metrics")) {
+                    serveMetrics(cnn);
+                } else if (mg_http_match_uri(msg, "/trace")) {
+                    serveTrace(cnn);
+                } else if (mg_http_match_uri(msg, "/telemetry")) {
+                    subscribeTelemetry(cnn, msg);
+                } else {
+                    mg_http_reply(cnn, 404, "", "Not found\n");
+                }
+                break;
+            }
+            case MG_EV_POLL:
+                if (cnn->is_websocket) sendTelemetry(cnn);
+                break;
+            case MG_EV_CLOSE:
+                if (cnn->is_websocket) m_numSubscribers--;
+                break;
+        }
+    }
+
+    /* Upgrades to WebSocket, ?rate=N selects frames per second up to TELEMETRY_MAX_RATE_HZ */
+    void subscribeTelemetry(mg_connection *cnn, mg_http_message *msg) {
+        static_assert(sizeof(TelemetrySubscription) <= MG_DATA_SIZE, "Telemetry state doesn't fit connection data");
+
+        char rateStr[16];
+        int rate = TELEMETRY_DEFAULT_RATE_HZ;
+
+        if (mg_http_get_var(&msg->query, "rate", rateStr, sizeof(rateStr)) > 0) {
+            rate = atoi(rateStr);
+            if (rate < 1) rate = 1;
+            if (rate > TELEMETRY_MAX_RATE_HZ) rate = TELEMETRY_MAX_RATE_HZ;
+        }
+
+        TelemetrySubscription subscription;
+        subscription.m_interval = NS_PER_SEC / rate;
+        subscription.m_nextSend = monotonicNs();
+        subscription.m_sequence[0] = 0;
+        subscription.m_sequence[1] = 0;
+        memcpy(cnn->data, &subscription, sizeof(subscription));
+
+        mg_ws_upgrade(cnn, msg, NULL);
+        m_numSubscribers++;
+    }
+
+    /* Frames come from the published axis snapshots only, unchanged state is not resent */
+    void sendTelemetry(mg_connection *cnn) {
+        TelemetrySubscription subscription;
+        memcpy(&subscription, cnn->data, sizeof(subscription));
+
+        int64_t now = monotonicNs();
+        if (now < subscription.m_nextSend) return;
+
+        subscription.m_nextSend += subscription.m_interval;
+        if (subscription.m_nextSend < now) subscription.m_nextSend = now + subscription.m_interval;
+
+        uint32_t sequence[2] = { m_mount.getAxisStateSequence(0), m_mount.getAxisStateSequence(1) };
+        bool changed = sequence[0] != subscription.m_sequence[0] || sequence[1] != subscription.m_sequence[1];
+
+        // Drop frames for subscribers that don't keep up instead of buffering without bound
+        if (changed && cnn->send.len < TELEMETRY_MAX_BACKLOG) {
+            char frame[512];
+            TextBuffer out(frame, sizeof(frame));
+            const char *separator = "";
+            out.printf("{\"axes\":[");
+
+            for (int axisIndex = 0; axisIndex < 2; axisIndex++) {
+                Brexos2AxisState state;
+                if (!m_mount.getAxisState(axisIndex, state)) continue;
+
+                out.printf("%s{\"axis\":%d,\"status\":%u,\"position\":%d,\"rate\":%d,\"gotoTarget\":%d,"
+                        "\"trackingRate\":%d,\"ageMs\":%.1f}", separator, axisIndex, state.m_status,
+                        state.m_position, state.m_rate, state.m_gotoTarget, state.m_trackingRate,
+                        (now - state.m_sampleTime) * 1e-6);
+                separator = ",";
+            }
+
+            out.printf("]}");
+            mg_ws_send(cnn, out.data(), out.length(), WEBSOCKET_OP_TEXT);
+            subscription.m_sequence[0] = sequence[0];
+            subscription.m_sequence[1] = sequence[1];
+        }
+
+        memcpy(cnn->data, &subscription, sizeof(subscription));
+    }
+
+    void serveMetrics(mg_connection *cnn) {
+        TextBuffer out(m_metricsBuffer, WEBSERVER_METRICS_BUFFER_SIZE);
+        MetricsRenderer(out).render(m_mount, m_pmc8Server);
+
+        mg_printf(cnn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+                out.length());
+        mg_send(cnn, out.data(), out.length());
+    }
+
+    /* Same JSON as the SIGUSR1 dump, rendered into memory */
+    void serveTrace(mg_connection *cnn) {
+        char *data = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&data, &size);
+        bool result = out != NULL && traceWriteJson(out);
+        if (out != NULL && fclose(out) != 0) result = false;
+
+        if (result) {
+            mg_printf(cnn, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n",
+                    (int) size);
+            mg_send(cnn, data, size);
+        } else {
+            mg_http_reply(cnn, 500, "", "Cannot render trace\n");
+        }
+
+        free(data);
     }
 };
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "simulator.cpp"
+
+static volatile bool stopRequested = false;
+
+static void onSignal(int) {
+    stopRequested = true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-l link] [-b baud] [-t turnaround_us] [-r ra_count] [-d dec_count] [-e interval] [-u seconds]\n"
+        "  -l link   create symlink to the pseudo terminal, e.g. /tmp/brexos2\n"
+        "  -b baud   emulated baud rate, 0 disables link timing (default %d)\n"
+        "  -t us     controller turnaround time before each response (default %d)\n"
+        "  -r, -d    initial RA and DEC counts\n"
+        "  -e n      mangle every nth response: drop it, cut it short or prefix noise, in turn\n"
+        "  -u s      reset the emulated USB adapter every s seconds, its device is gone for %d ms\n",
+        name, SIM_DEFAULT_BAUD_RATE, SIM_DEFAULT_TURNAROUND_US, SIM_RESET_DOWNTIME_MS);
+}
+
+int main(int argc, char **argv) {
+    Exos2Simulator simulator;
+    const char *linkPath = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:b:t:r:d:e:u:h")) != -1) {
+        switch (opt) {
+            case 'l': linkPath = optarg; break;
+            case 'b': simulator.setBaudRate(atoi(optarg)); break;
+            case 't': simulator.setTurnaroundTime(atoi(optarg)); break;
+            case 'r': simulator.setPosition(BREXOS2_AXIS_INDEX_RA, strtol(optarg, NULL, 0)); break;
+            case 'd': simulator.setPosition(BREXOS2_AXIS_INDEX_DEC, strtol(optarg, NULL, 0)); break;
+            case 'e': simulator.setFaultInterval(atoi(optarg)); break;
+            case 'u': simulator.setResetInterval(atoi(optarg)); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (true) {
+        const char *ptyPath = simulator.open();
+
+        if (ptyPath == NULL) {
+            fprintf(stderr, "Cannot open pseudo terminal: %d\n", errno);
+            return 1;
+        }
+
+        if (linkPath != NULL) {
+            struct stat st;
+
+            if (lstat(linkPath, &st) == 0 && S_ISLNK(st.st_mode)) {
+                unlink(linkPath);
+            }
+
+            if (symlink(ptyPath, linkPath) == -1) {
+                fprintf(stderr, "Cannot create symlink %s: %d\n", linkPath, errno);
+                return 1;
+            }
+        }
+
+        printf("EXOS2 simulator listening on %s\n", linkPath != NULL ? linkPath : ptyPath);
+        fflush(stdout);
+
+        if (!simulator.run(stopRequested)) break;
+
+        // Like udev, removes the device and its symlink until the adapter is back
+        simulator.close();
+        if (linkPath != NULL) unlink(linkPath);
+        usleep(SIM_RESET_DOWNTIME_MS * 1000);
+    }
+
+    simulator.printStats();
+
+    if (linkPath != NULL) {
+        unlink(linkPath);
+    }
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+#pragma once
+#include <cstdio>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <math.h>
+#include "clock.cpp"
+#include "debug.cpp"
+#include "fd.cpp"
+#include "ringbuffer.cpp"
+#include "protocol.cpp"
+
+// Counts per second for one unit of slew/goto rate, sidereal rate 5 is ~38 counts/s
+#define SIM_COUNTS_PER_SEC_PER_RATE (38.0 / 5.0)
+#define SIM_DEFAULT_BAUD_RATE 9600
+#define SIM_DEFAULT_TURNAROUND_US 2000
+#define SIM_POLL_INTERVAL_MS 5
+#define SIM_RESET_DOWNTIME_MS 300 // Pseudo terminal is gone this long when the emulated adapter resets
+
+struct SimAxis {
+    double m_position;
+    int m_rate;
+    bool m_negative;
+    bool m_goto;
+    int m_gotoRate;
+    int m_gotoTarget;
+    unsigned m_param0f;
+
+    SimAxis(): m_position(0), m_rate(0), m_negative(false), m_goto(false), m_gotoRate(0), m_gotoTarget(0),
+            m_param0f(0) {
+    }
+
+    uint8_t getStatus(bool enabled) const {
+        uint8_t status = 0;
+
+        if (!enabled) status |= BREXOS2_AXIS_STATUS_DISABLED;
+        if (!m_goto) status |= BREXOS2_AXIS_STATUS_SLEWING;
+        if (m_negative) status |= BREXOS2_AXIS_STATUS_DIRECTION;
+        return status;
+    }
+
+    void stop() {
+        m_rate = 0;
+        m_goto = false;
+    }
+
+    void advance(double seconds) {
+        if (m_goto) {
+            double remaining = m_gotoTarget - m_position;
+            double step = m_gotoRate * SIM_COUNTS_PER_SEC_PER_RATE * seconds;
+
+            m_negative = remaining < 0;
+
+            if (fabs(remaining) <= step) {
+                m_position = m_gotoTarget;
+                m_goto = false;
+                m_rate = 0;
+            } else {
+                m_position += remaining < 0 ? -step : step;
+            }
+        } else {
+            m_position += m_rate * SIM_COUNTS_PER_SEC_PER_RATE * seconds;
+        }
+    }
+};
+
+/*
+ * Emulates EXOS2 motor controllers behind a pseudo terminal. Frames are answered in order and delayed
+ * according to the emulated baud rate, so that the bridge sees realistic link timing.
+ */
+class Exos2Simulator {
+    FileDescriptor m_master;
+    FileDescriptor m_slave; // Kept open so that the master doesn't hang up between client sessions
+    RingBuffer<512> m_input; // Room for the longest frame a length byte can announce
+    SimAxis m_axes[2];
+    bool m_enabled;
+    int64_t m_byteTime;
+    int64_t m_turnaroundTime;
+    int64_t m_lastAdvance;
+    int64_t m_wireFreeAt;
+    unsigned m_numFrames;
+    unsigned m_faultInterval;  // Every this many responses one is mangled, 0 for none
+    unsigned m_numResponses;
+    unsigned m_numFaults;
+    int64_t m_resetInterval;   // Emulated USB adapter resets this often, 0 for never
+    int64_t m_nextReset;
+
+public:
+    Exos2Simulator(): m_enabled(false), m_byteTime(10 * NS_PER_SEC / SIM_DEFAULT_BAUD_RATE),
+            m_turnaroundTime(SIM_DEFAULT_TURNAROUND_US * 1000LL), m_lastAdvance(0), m_wireFreeAt(0), m_numFrames(0),
+            m_faultInterval(0), m_numResponses(0), m_numFaults(0), m_resetInterval(0), m_nextReset(0) {
+    }
+
+    void setBaudRate(int baudRate) {
+        m_byteTime = baudRate > 0 ? 10 * NS_PER_SEC / baudRate : 0;
+    }
+
+    void setTurnaroundTime(int us) {
+        m_turnaroundTime = us * 1000LL;
+    }
+
+    void setFaultInterval(unsigned interval) {
+        m_faultInterval = interval;
+    }
+
+    void setResetInterval(int seconds) {
+        m_resetInterval = seconds * NS_PER_SEC;
+    }
+
+    void setPosition(uint8_t axisIndex, int position) {
+        m_axes[axisIndex].m_position = position;
+    }
+
+    const char *open() {
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master == -1) return NULL;
+        m_master.set(master);
+
+        if (grantpt(master) == -1 || unlockpt(master) == -1) return NULL;
+
+        const char *slavePath = ptsname(master);
+        if (slavePath == NULL) return NULL;
+
+        int slave = ::open(slavePath, O_RDWR | O_NOCTTY);
+        if (slave == -1) return NULL;
+        m_slave.set(slave);
+
+        termios params;
+        if (tcgetattr(slave, &params) == -1) return NULL;
+        cfmakeraw(&params);
+        if (tcsetattr(slave, TCSANOW, &params) == -1) return NULL;
+
+        // Axes keep moving while the adapter is away
+        if (m_lastAdvance == 0) m_lastAdvance = monotonicNs();
+
+        m_nextReset = m_resetInterval != 0 ? monotonicNs() + m_resetInterval : 0;
+        return slavePath;
+    }
+
+    /* Hangs up the pseudo terminal, the bridge sees its device fail */
+    void close() {
+        m_master.close();
+        m_slave.close();
+        m_input.clear();
+        m_wireFreeAt = 0;
+    }
+
+    /* Returns true when the emulated adapter resets, it is then closed and opened again */
+    bool run(volatile bool &stopRequested) {
+        pollfd pfd;
+        pfd.fd = m_master;
+        pfd.events = POLLIN;
+
+        while (!stopRequested) {
+            int result = poll(&pfd, 1, SIM_POLL_INTERVAL_MS);
+
+            if (result == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "poll failed: %d\n", errno);
+                break;
+            }
+
+            if (result == 1 && (pfd.revents & POLLIN)) {
+                if (m_input.readFrom(m_master) <= 0 && errno != EAGAIN && errno != EIO) {
+                    fprintf(stderr, "Read failed: %d\n", errno);
+                    break;
+                }
+            }
+
+            advance();
+            processInput();
+
+            if (m_nextReset != 0 && monotonicNs() >= m_nextReset) {
+                puts("Adapter reset");
+                fflush(stdout);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void printStats() {
+        printf("Frames processed: %u\n", m_numFrames);
+        if (m_faultInterval != 0) printf("Responses mangled: %u\n", m_numFaults);
+    }
+
+private:
+    void advance() {
+        int64_t now = monotonicNs();
+        double seconds = (now - m_lastAdvance) * 1e-9;
+        m_lastAdvance = now;
+
+        if (!m_enabled) return;
+
+        m_axes[0].advance(seconds);
+        m_axes[1].advance(seconds);
+    }
+
+    void processInput() {
+        while (m_input.size() >= 4) {
+            if (m_input[0] != 0x55 || m_input[1] != 0xaa || m_input[2] != 0x01) {
+                m_input.consume(1);
+                continue;
+            }
+
+            unsigned frameLen = m_input[3] + BREXOS2_FRAME_HEADER_LEN;
+            if (m_input.size() < frameLen) break;
+
+            uint8_t frame[BREXOS2_MAX_FRAME_LEN];
+            m_input.peek(frame, frameLen);
+            m_input.consume(frameLen);
+            m_numFrames++;
+            processFrame(frame, frameLen);
+        }
+    }
+
+    void processFrame(const uint8_t *frame, unsigned frameLen) {
+        const uint8_t *payload = frame + BREXOS2_FRAME_HEADER_LEN;
+        unsigned payloadLen = frameLen - BREXOS2_FRAME_HEADER_LEN;
+        uint8_t response[16] = { 0x55, 0xaa, 0x01, 0x01, payload[0] };
+        int responseLen = 5;
+
+        if (payloadLen == 0) return;
+
+        if (payloadLen == 1 && (payload[0] == 0x00 || payload[0] == 0xff)) {
+            m_enabled = payload[0] == 0xff;
+            dprintf("Motors %s\n", m_enabled ? "enabled" : "disabled");
+
+            if (!m_enabled) {
+                m_axes[0].stop();
+                m_axes[1].stop();
+            }
+
+            delayResponse(frameLen, 0);
+            return; // Enable has no response
+        }
+
+        uint8_t axisIndex = payload[0] >> 5;
+        if (axisIndex > 1) return;
+        SimAxis &axis = m_axes[axisIndex];
+
+        switch (payload[0] & 0x1f) {
+            case 0x01: { // Slew
+                if (payloadLen < 4) return;
+                int rate = payload[2] << 8 | payload[3];
+
+                axis.m_goto = false;
+                axis.m_negative = payload[1] == 0;
+                axis.m_rate = m_enabled ? (axis.m_negative ? -rate : rate) : 0;
+                dprintf("Axis %u slew %d\n", axisIndex, axis.m_rate);
+                break;
+            }
+            case 0x02: { // Goto
+                if (payloadLen < 6) return;
+                int target = (int8_t) payload[3];
+                target = (target << 8) | payload[4];
+                target = (target << 8) | payload[5];
+
+                axis.m_gotoRate = payload[1] << 8 | payload[2];
+                axis.m_gotoTarget = target;
+                axis.m_goto = m_enabled && axis.m_gotoRate != 0;
+                dprintf("Axis %u goto %d rate %d\n", axisIndex, target, axis.m_gotoRate);
+                break;
+            }
+            case 0x04: { // Inquiry
+                int position = (int) lround(axis.m_position);
+
+                response[3] = 5;
+                response[5] = axis.getStatus(m_enabled);
+                response[6] = position >> 16;
+                response[7] = position >> 8;
+                response[8] = position;
+                responseLen = 9;
+                break;
+            }
+            case 0x0f:
+                if (payloadLen < 3) return;
+                axis.m_param0f = payload[1] << 8 | payload[2];
+                break;
+            case 0x10:
+                response[3] = 3;
+                response[5] = axis.m_param0f >> 8;
+                response[6] = axis.m_param0f;
+                responseLen = 7;
+                break;
+            default:
+                fprintf(stderr, "Unknown command %02X\n", payload[0]);
+                return;
+        }
+
+        delayResponse(frameLen, responseLen);
+        writeResponse(response, responseLen);
+    }
+
+    /* Line glitches for testing the bridge's recovery: drops, truncates or prefixes noise to a response in turn */
+    void writeResponse(const uint8_t *response, int responseLen) {
+        uint8_t buf[32];
+        int len = responseLen;
+        memcpy(buf, response, responseLen);
+
+        if (m_faultInterval != 0 && ++m_numResponses % m_faultInterval == 0) {
+            static const uint8_t noise[] = { 0x55, 0x13, 0xaa, 0x00 };
+
+            switch (m_numFaults++ % 3) {
+                case 0: len = 0; break;
+                case 1: len = responseLen / 2; break;
+                case 2:
+                    memcpy(buf, noise, sizeof(noise));
+                    memcpy(buf + sizeof(noise), response, responseLen);
+                    len = sizeof(noise) + responseLen;
+                    break;
+            }
+        }
+
+        if (len != 0 && write(m_master, buf, len) != len) {
+            fprintf(stderr, "Write failed: %d\n", errno);
+        }
+    }
+
+    /* Sleeps until the command and the response would have been transferred over the emulated link */
+    void delayResponse(unsigned cmdLen, unsigned responseLen) {
+        int64_t now = monotonicNs();
+        int64_t start = m_wireFreeAt > now ? m_wireFreeAt : now;
+        int64_t done = start + cmdLen * m_byteTime + (responseLen != 0 ? m_turnaroundTime : 0) +
+                responseLen * m_byteTime;
+
+        m_wireFreeAt = done;
+
+        timespec deadline = { (time_t) (done / NS_PER_SEC), (long) (done % NS_PER_SEC) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    }
+};
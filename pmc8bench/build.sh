@@ -0,0 +1,7 @@
+#!/bin/bash
+
+if [ ! -d target ]; then
+    mkdir target
+fi
+
+g++ -O2 -fno-exceptions -fno-rtti -fvisibility=hidden -o target/pmc8bench -Isrc src/main.cpp -lpthread
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "clock.cpp"
+
+#define BENCH_RESPONSE_TIMEOUT_MS 2000
+#define BENCH_MAX_CONNECTIONS 64
+
+enum CommandType {
+    CMD_GP0,
+    CMD_GP1,
+    CMD_GR,
+    CMD_SR,
+    CMD_PT,
+    CMD_TR,
+    CMD_COUNT
+};
+
+static const char *commandNames[CMD_COUNT] = { "ESGp0", "ESGp1", "ESGr", "ESSr", "ESPt", "ESTr" };
+static const char *mixNames[CMD_COUNT] = { "gp0", "gp1", "gr", "sr", "pt", "tr" };
+
+struct BenchConfig {
+    const char *host;
+    int port;
+    int connections;
+    double rate;
+    double duration;
+    int weights[CMD_COUNT];
+    unsigned trackingRate;
+
+    BenchConfig(): host("127.0.0.1"), port(8888), connections(1), rate(10), duration(10), trackingRate(0x04b0) {
+        const int defaultWeights[CMD_COUNT] = { 40, 40, 10, 5, 0, 5 };
+        memcpy(weights, defaultWeights, sizeof(weights));
+    }
+};
+
+struct LatencySamples {
+    int64_t *m_samples;
+    unsigned m_count;
+    unsigned m_capacity;
+    unsigned m_errors;
+
+    LatencySamples(): m_samples(NULL), m_count(0), m_capacity(0), m_errors(0) {
+    }
+
+    ~LatencySamples() {
+        free(m_samples);
+    }
+
+    void add(int64_t latency) {
+        if (m_count == m_capacity) {
+            unsigned capacity = m_capacity != 0 ? m_capacity * 2 : 1024;
+            int64_t *samples = (int64_t *) realloc(m_samples, capacity * sizeof(int64_t));
+            if (samples == NULL) return;
+
+            m_samples = samples;
+            m_capacity = capacity;
+        }
+
+        m_samples[m_count++] = latency;
+    }
+
+    void merge(const LatencySamples &other) {
+        for (unsigned i = 0; i < other.m_count; i++) {
+            add(other.m_samples[i]);
+        }
+
+        m_errors += other.m_errors;
+    }
+};
+
+struct Connection {
+    const BenchConfig *m_config;
+    pthread_t m_thread;
+    int m_socket;
+    unsigned m_seed;
+    int m_lastPosition;
+    LatencySamples m_latencies[CMD_COUNT];
+    char m_rxBuf[64];
+    int m_rxLen;
+
+    Connection(): m_config(NULL), m_socket(-1), m_seed(0), m_lastPosition(0), m_rxLen(0) {
+    }
+
+    ~Connection() {
+        if (m_socket != -1) close(m_socket);
+    }
+
+    bool connectTo() {
+        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_socket == -1) return false;
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_config->port);
+        if (inet_pton(AF_INET, m_config->host, &addr.sin_addr) != 1) return false;
+        if (connect(m_socket, (sockaddr *) &addr, sizeof(addr)) == -1) return false;
+
+        int noDelay = 1;
+        setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        return true;
+    }
+
+    CommandType pickCommand() {
+        int total = 0;
+        for (int i = 0; i < CMD_COUNT; i++) total += m_config->weights[i];
+
+        int pick = rand_r(&m_seed) % total;
+
+        for (int i = 0; i < CMD_COUNT; i++) {
+            pick -= m_config->weights[i];
+            if (pick < 0) return (CommandType) i;
+        }
+
+        return CMD_GP0;
+    }
+
+    int formatCommand(CommandType type, char *buf, int len) {
+        switch (type) {
+            case CMD_GP0: return snprintf(buf, len, "ESGp0!");
+            case CMD_GP1: return snprintf(buf, len, "ESGp1!");
+            case CMD_GR: return snprintf(buf, len, "ESGr%d!", rand_r(&m_seed) & 1);
+            case CMD_SR: return snprintf(buf, len, "ESSr10000!"); // Stop DEC, harmless while tracking
+            case CMD_PT: return snprintf(buf, len, "ESPt0%06X!", m_lastPosition & 0xffffff); // Goto where RA is
+            case CMD_TR: return snprintf(buf, len, "ESTr%04X!", m_config->trackingRate & 0xffff);
+            default: return 0;
+        }
+    }
+
+    /* Reads one '!' terminated response, returns its length or -1 */
+    int readResponse(char *response, int len) {
+        while (true) {
+            char *end = (char *) memchr(m_rxBuf, '!', m_rxLen);
+
+            if (end != NULL) {
+                int responseLen = end - m_rxBuf + 1;
+                if (responseLen > len) responseLen = len;
+
+                memcpy(response, m_rxBuf, responseLen);
+                m_rxLen -= end - m_rxBuf + 1;
+                memmove(m_rxBuf, end + 1, m_rxLen);
+                return responseLen;
+            }
+
+            if (m_rxLen == (int) sizeof(m_rxBuf)) m_rxLen = 0; // Garbage, drop it
+
+            pollfd pfd = { m_socket, POLLIN, 0 };
+            if (poll(&pfd, 1, BENCH_RESPONSE_TIMEOUT_MS) != 1) return -1;
+
+            ssize_t numRead = read(m_socket, m_rxBuf + m_rxLen, sizeof(m_rxBuf) - m_rxLen);
+            if (numRead <= 0) return -1;
+            m_rxLen += numRead;
+        }
+    }
+
+    void run() {
+        int64_t interval = (int64_t) (m_config->connections * NS_PER_SEC / m_config->rate);
+        if (interval < 1) interval = 1; // Rates beyond a command per ns just send flat out
+        int64_t start = monotonicNs();
+        int64_t end = start + (int64_t) (m_config->duration * NS_PER_SEC);
+        int64_t next = start + rand_r(&m_seed) % interval; // Spread connections over the interval
+
+        while (next < end) {
+            timespec deadline = { (time_t) (next / NS_PER_SEC), (long) (next % NS_PER_SEC) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+            CommandType type = pickCommand();
+            char cmd[32];
+            char response[32];
+            int cmdLen = formatCommand(type, cmd, sizeof(cmd));
+
+            int64_t sent = monotonicNs();
+
+            if (write(m_socket, cmd, cmdLen) != cmdLen) {
+                m_latencies[type].m_errors++;
+                break;
+            }
+
+            int responseLen = readResponse(response, sizeof(response));
+            int64_t received = monotonicNs();
+
+            if (responseLen < 0) {
+                m_latencies[type].m_errors++;
+                break;
+            }
+
+            m_latencies[type].add(received - sent);
+
+            if (type == CMD_GP0 && responseLen == 12) {
+                m_lastPosition = strtol(response + 5, NULL, 16);
+            }
+
+            next += interval;
+            if (next < received) next = received; // Fall back to closed loop when the server can't keep up
+        }
+    }
+
+    static void *threadProc(void *arg) {
+        ((Connection *) arg)->run();
+        return NULL;
+    }
+};
+
+static int compareInt64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentileUs(const LatencySamples &samples, double percentile) {
+    if (samples.m_count == 0) return 0;
+
+    unsigned index = (unsigned) (percentile / 100.0 * (samples.m_count - 1) + 0.5);
+    return samples.m_samples[index] / 1000.0;
+}
+
+static bool parseMix(const char *mix, BenchConfig &config) {
+    memset(config.weights, 0, sizeof(config.weights));
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", mix);
+
+    for (char *save, *item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (eq == NULL) return false;
+        *eq = 0;
+
+        int i = 0;
+        while (i < CMD_COUNT && strcmp(item, mixNames[i]) != 0) i++;
+        if (i == CMD_COUNT) return false;
+
+        config.weights[i] = atoi(eq + 1);
+    }
+
+    int total = 0;
+    for (int i = 0; i < CMD_COUNT; i++) total += config.weights[i];
+    return total > 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-p port] [-c connections] [-r rate] [-t seconds] [-m mix] [-T tracking_rate]\n"
+        "  -r rate   total commands per second over all connections (default 10)\n"
+        "  -m mix    command weights, default gp0=40,gp1=40,gr=10,sr=5,pt=0,tr=5\n"
+        "            pt sends goto to the last RA position read, sr stops DEC\n"
+        "  -T rate   hex rate sent with ESTr (default 04B0, sidereal)\n",
+        name);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:r:t:m:T:h")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 't': config.duration = atof(optarg); break;
+            case 'T': config.trackingRate = strtoul(optarg, NULL, 16); break;
+            case 'm':
+                if (!parseMix(optarg, config)) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (config.connections < 1 || config.connections > BENCH_MAX_CONNECTIONS || config.rate <= 0
+            || config.duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Connection *connections = new Connection[config.connections];
+
+    for (int i = 0; i < config.connections; i++) {
+        connections[i].m_config = &config;
+        connections[i].m_seed = i + 1;
+
+        if (!connections[i].connectTo()) {
+            fprintf(stderr, "Cannot connect to %s:%d: %d\n", config.host, config.port, errno);
+            delete[] connections;
+            return 1;
+        }
+    }
+
+    int64_t start = monotonicNs();
+
+    for (int i = 0; i < config.connections; i++) {
+        pthread_create(&connections[i].m_thread, NULL, Connection::threadProc, &connections[i]);
+    }
+
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(connections[i].m_thread, NULL);
+    }
+
+    double elapsed = (monotonicNs() - start) * 1e-9;
+    LatencySamples total;
+
+    printf("%d connections, %.1f s\n\n", config.connections, elapsed);
+    printf("%-8s %8s %7s %9s %10s %10s %10s %10s\n", "Command", "Count", "Errors", "Rate/s", "p50 us",
+            "p90 us", "p99 us", "max us");
+
+    for (int type = 0; type < CMD_COUNT; type++) {
+        LatencySamples merged;
+
+        for (int i = 0; i < config.connections; i++) {
+            merged.merge(connections[i].m_latencies[type]);
+        }
+
+        if (merged.m_count == 0 && merged.m_errors == 0) continue;
+
+        total.merge(merged);
+        qsort(merged.m_samples, merged.m_count, sizeof(int64_t), compareInt64);
+        printf("%-8s %8u %7u %9.1f %10.1f %10.1f %10.1f %10.1f\n", commandNames[type], merged.m_count,
+                merged.m_errors, merged.m_count / elapsed, percentileUs(merged, 50), percentileUs(merged, 90),
+                percentileUs(merged, 99), percentileUs(merged, 100));
+    }
+
+    qsort(total.m_samples, total.m_count, sizeof(int64_t), compareInt64);
+    printf("%-8s %8u %7u %9.1f %10.1f %10.1f %10.1f %10.1f\n", "all", total.m_count, total.m_errors,
+            total.m_count / elapsed, percentileUs(total, 50), percentileUs(total, 90), percentileUs(total, 99),
+            percentileUs(total, 100));
+
+    delete[] connections;
+    return total.m_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1 @@
+../../brexos2pmc8/src/brexos2.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../brexos2pmc8/src/fd.cpp
\ No newline at end of file
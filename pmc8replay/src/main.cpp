@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "clock.cpp"
+#include "recorder.cpp"
+#include "brexos2.cpp"
+#include "pmc8server.cpp"
+#include "replay.cpp"
+
+#define REPLAY_DEFAULT_POSITION_TOLERANCE 100
+
+static void *serverThreadProc(void *arg) {
+    ((Pmc8Server *) arg)->run();
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-s speed] [-t counts] [-g rate,acceleration,jerk] recording\n"
+        "  -s speed   1 replays in real time (default), 2 twice as fast, 0 as fast as the bridge answers\n"
+        "  -t counts  ESGp responses may differ from the recorded ones by this much (default %d)\n"
+        "  -g         goto limits of the bridge, as with brexos2pmc8\n",
+        name, REPLAY_DEFAULT_POSITION_TOLERANCE);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int positionTolerance = REPLAY_DEFAULT_POSITION_TOLERANCE;
+    int gotoRate = 0, gotoAcceleration = 0, gotoJerk = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:g:h")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 't': positionTolerance = atoi(optarg); break;
+            case 'g':
+                if (sscanf(optarg, "%d,%d,%d", &gotoRate, &gotoAcceleration, &gotoJerk) != 3) {
+                    fputs("Goto limits must be rate,acceleration,jerk\n", stderr);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    SerialRecording recording;
+    ReplaySession session;
+
+    if (!recording.open(argv[optind]) || !session.load(recording)) return 1;
+
+    const RecordArray<Pmc8Exchange> &pmc8 = session.pmc8();
+
+    if (pmc8.count() == 0) {
+        fputs("Recording has no PMC8 commands\n", stderr);
+        return 1;
+    }
+
+    int64_t firstCommand = pmc8[0].m_time;
+    int64_t lastCommand = pmc8[pmc8.count() - 1].m_time;
+    ReplayClock clock(speed, firstCommand);
+    MountReplayer replayer(session, clock);
+    const char *ptyPath = replayer.start();
+
+    if (ptyPath == NULL) {
+        fprintf(stderr, "Cannot open pseudo terminal: %d\n", errno);
+        return 1;
+    }
+
+    // Server thread never returns, so neither the server nor the mount it drives is ever destroyed
+    Brexos2Direct *mount = new Brexos2Direct();
+    Pmc8Server *server = new Pmc8Server(*mount);
+    pthread_t serverThread;
+
+    if (gotoRate != 0) mount->setGotoLimits(gotoRate, gotoAcceleration, gotoJerk);
+
+    if (!mount->init(ptyPath)) {
+        fputs("Cannot connect to replayed mount\n", stderr);
+        return 1;
+    }
+
+    if (!server->init(0) || pthread_create(&serverThread, NULL, serverThreadProc, server) != 0) {
+        fputs("Cannot start PMC8 server\n", stderr);
+        return 1;
+    }
+
+    Pmc8Replayer client(session, clock, server->getPort(), positionTolerance);
+    int64_t start = monotonicNs();
+
+    clock.start();
+    bool completed = client.run();
+    double elapsed = (monotonicNs() - start) * 1e-9;
+
+    replayer.stop();
+    replayer.findMissingMotion(firstCommand, lastCommand);
+
+    printf("%u PMC8 commands, %u serial frames in %.1f s, recording %.1f s\n\n", pmc8.count(),
+            replayer.numFrames(), elapsed, (lastCommand - firstCommand) * 1e-9);
+    printf("%-8s %8s %9s %7s %10s %10s %10s %10s\n", "Command", "Count", "Diverged", "Failed", "p50 us",
+            "p90 us", "p99 us", "max us");
+
+    unsigned diverged = 0;
+    unsigned failures = 0;
+
+    for (int command = 0; command < PMC8_CMD_COUNT; command++) {
+        const Histogram &latency = client.latency(command);
+        if (latency.count() == 0 && client.failures(command) == 0) continue;
+
+        diverged += client.diverged(command);
+        failures += client.failures(command);
+        printf("%-8s %8llu %9u %7u %10llu %10llu %10llu %10llu\n", pmc8CommandNames[command],
+                (unsigned long long) latency.count(), client.diverged(command), client.failures(command),
+                (unsigned long long) latency.percentile(50), (unsigned long long) latency.percentile(90),
+                (unsigned long long) latency.percentile(99), (unsigned long long) latency.max());
+    }
+
+    const Histogram &total = client.totalLatency();
+    printf("%-8s %8llu %9u %7u %10llu %10llu %10llu %10llu\n", "all", (unsigned long long) total.count(),
+            diverged, failures, (unsigned long long) total.percentile(50),
+            (unsigned long long) total.percentile(90), (unsigned long long) total.percentile(99),
+            (unsigned long long) total.max());
+
+    printf("\nMax ESGp position error: %d counts\n", client.maxPositionError());
+    printf("Serial frames: %u without an identical recorded frame, %u unanswered\n", replayer.numUnmatched(),
+            replayer.numUnanswered());
+    printf("Motion frames: %u extra, %u missing\n", replayer.numExtraMotion(), replayer.numMissingMotion());
+
+    if (client.divergences().count() != 0 || replayer.divergences().count() != 0) {
+        puts("\nDivergences:");
+        client.divergences().print();
+        replayer.divergences().print();
+    }
+
+    bool clean = completed && client.divergences().count() == 0 && replayer.divergences().count() == 0;
+
+    // Bridge threads are still running, leave without unwinding the objects they use
+    fflush(stdout);
+    exit(clean ? 0 : 1);
+}
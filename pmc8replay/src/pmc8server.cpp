@@ -0,0 +1 @@
+../../brexos2pmc8/src/pmc8server.cpp
\ No newline at end of file
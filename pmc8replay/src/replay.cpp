@@ -0,0 +1,835 @@
+#pragma once
+#include <cstdio>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "clock.cpp"
+#include "fd.cpp"
+#include "histogram.cpp"
+#include "ringbuffer.cpp"
+#include "recorder.cpp"
+#include "serial.cpp"
+#include "pmc8server.cpp"
+
+#define REPLAY_POLL_INTERVAL_MS 5
+#define REPLAY_RESPONSE_TIMEOUT_MS 2000
+#define REPLAY_SERIAL_TIMEOUT_MS 1000    // Recorded response this late belongs to a later frame, the earlier one failed
+#define REPLAY_MOTION_TOLERANCE_MS 1000  // Replayed slew/goto/enable frame matches a recorded one this close in time
+#define REPLAY_RATE_TOLERANCE_PERCENT 10  // Goto ramps follow the manager's ticks, their rates never repeat exactly
+#define REPLAY_MAX_DIVERGENCE_LINES 20
+#define REPLAY_DIVERGENCE_LINE_LEN 160
+
+/* Growable array of plain structs, items are zeroed when added */
+template <typename T>
+class RecordArray {
+    T *m_items;
+    unsigned m_count;
+    unsigned m_capacity;
+
+public:
+    RecordArray(): m_items(NULL), m_count(0), m_capacity(0) {
+    }
+
+    ~RecordArray() {
+        free(m_items);
+    }
+
+    /* Returns NULL if out of memory */
+    T *add() {
+        if (m_count == m_capacity) {
+            unsigned capacity = m_capacity != 0 ? m_capacity * 2 : 1024;
+            T *items = (T *) realloc(m_items, capacity * sizeof(T));
+            if (items == NULL) return NULL;
+
+            m_items = items;
+            m_capacity = capacity;
+        }
+
+        T *item = &m_items[m_count++];
+        memset(item, 0, sizeof(T));
+        return item;
+    }
+
+    unsigned count() const {
+        return m_count;
+    }
+
+    T& operator[](unsigned index) {
+        return m_items[index];
+    }
+
+    const T& operator[](unsigned index) const {
+        return m_items[index];
+    }
+};
+
+/* Frame the bridge wrote to the mount and the mount's response */
+struct SerialExchange {
+    int64_t m_time;           // CLOCK_MONOTONIC ns of the recording when the frame was written
+    int64_t m_responseDelay;  // Until the whole response had arrived
+    int64_t m_firstByteDelay; // Until its first byte arrived
+    uint8_t m_cmd[SERIAL_MAX_FRAME_LEN];
+    int m_cmdLen;
+    uint8_t m_response[SERIAL_MAX_FRAME_LEN];
+    int m_responseLen;        // 0 if the mount didn't answer
+};
+
+/* PMC8 command from a client and the bridge's response */
+struct Pmc8Exchange {
+    int64_t m_time;
+    uint8_t m_session;
+    char m_command[PMC8_MAX_COMMAND_LEN];
+    int m_commandLen;
+    char m_response[PMC8_MAX_COMMAND_LEN];
+    int m_responseLen;
+};
+
+static SerialOp getFrameOp(const uint8_t *frame, int len) {
+    return SerialTransaction(frame, len).getOp();
+}
+
+static bool isMotionFrame(const uint8_t *frame, int len) {
+    SerialOp op = getFrameOp(frame, len);
+    return op == SERIAL_OP_SLEW || op == SERIAL_OP_GOTO || op == SERIAL_OP_ENABLE;
+}
+
+/* Keeps the first few divergences for the report and counts all of them */
+class DivergenceLog {
+    char m_lines[REPLAY_MAX_DIVERGENCE_LINES][REPLAY_DIVERGENCE_LINE_LEN];
+    unsigned m_count;
+
+public:
+    DivergenceLog(): m_count(0) {
+    }
+
+    void add(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        if (m_count < REPLAY_MAX_DIVERGENCE_LINES) {
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(m_lines[m_count], REPLAY_DIVERGENCE_LINE_LEN, fmt, args);
+            va_end(args);
+        }
+
+        m_count++;
+    }
+
+    unsigned count() const {
+        return m_count;
+    }
+
+    void print() const {
+        for (unsigned i = 0; i < m_count && i < REPLAY_MAX_DIVERGENCE_LINES; i++) {
+            printf("  %s\n", m_lines[i]);
+        }
+
+        if (m_count > REPLAY_MAX_DIVERGENCE_LINES) {
+            printf("  ... and %u more\n", m_count - REPLAY_MAX_DIVERGENCE_LINES);
+        }
+    }
+};
+
+/*
+ * Serial exchanges and PMC8 commands of a recording in recorded order. Responses are paired with frames the way
+ * SerialLink does it, the mount answers in order, except that a frame whose response would have arrived too late
+ * is taken as failed.
+ */
+class ReplaySession {
+    RecordArray<SerialExchange> m_serial;
+    RecordArray<Pmc8Exchange> m_pmc8;
+
+    RingBuffer<256> m_rx;
+    int64_t m_rxStart;  // When the first byte still in m_rx arrived
+    unsigned m_pending[SERIAL_QUEUE_SIZE]; // Exchanges still waiting for a response
+    unsigned m_pendingHead;
+    unsigned m_pendingTail;
+    int m_pendingPmc8[PMC8_MAX_SESSIONS];
+
+public:
+    ReplaySession(): m_rxStart(0), m_pendingHead(0), m_pendingTail(0) {
+        for (int i = 0; i < PMC8_MAX_SESSIONS; i++) {
+            m_pendingPmc8[i] = -1;
+        }
+    }
+
+    bool load(const SerialRecording &recording) {
+        bool result = true;
+
+        recording.forEach([&](const RecordHeader &header, const uint8_t *payload) {
+            if (!result) return;
+
+            switch (header.m_direction) {
+                case RECORD_TX: result = addFrame(header.m_time, payload, header.m_length); break;
+                case RECORD_RX: addResponseBytes(header.m_time, payload, header.m_length); break;
+                case RECORD_DEVICE_LOST: m_pendingHead = m_pendingTail; m_rx.clear(); break;
+                case RECORD_PMC8_COMMAND: result = addPmc8Command(header, payload); break;
+                case RECORD_PMC8_RESPONSE: addPmc8Response(header, payload); break;
+            }
+        });
+
+        if (!result) fputs("Out of memory loading recording\n", stderr);
+        return result;
+    }
+
+    const RecordArray<SerialExchange>& serial() const {
+        return m_serial;
+    }
+
+    const RecordArray<Pmc8Exchange>& pmc8() const {
+        return m_pmc8;
+    }
+
+private:
+    bool addFrame(int64_t time, const uint8_t *frame, int len) {
+        if (len > SERIAL_MAX_FRAME_LEN) return true;
+
+        SerialExchange *exchange = m_serial.add();
+        if (exchange == NULL) return false;
+
+        exchange->m_time = time;
+        memcpy(exchange->m_cmd, frame, len);
+        exchange->m_cmdLen = len;
+
+        if (getFrameOp(frame, len) != SERIAL_OP_ENABLE) {
+            if (m_pendingTail - m_pendingHead == SERIAL_QUEUE_SIZE) m_pendingHead++;
+            m_pending[m_pendingTail++ % SERIAL_QUEUE_SIZE] = m_serial.count() - 1;
+        }
+
+        return true;
+    }
+
+    void addResponseBytes(int64_t time, const uint8_t *data, int len) {
+        if (m_rx.size() == 0) m_rxStart = time;
+
+        if (!m_rx.append(data, len)) {
+            m_rx.clear();
+            return;
+        }
+
+        while (m_rx.size() >= 4) {
+            if (m_rx[0] != 0x55 || m_rx[1] != 0xaa || m_rx[2] != 0x01) {
+                m_rx.consume(1);
+                continue;
+            }
+
+            unsigned frameLen = m_rx[3] + 4;
+
+            if (frameLen > SERIAL_MAX_FRAME_LEN) {
+                m_rx.consume(1);
+                continue;
+            }
+
+            if (m_rx.size() < frameLen) break;
+
+            uint8_t response[SERIAL_MAX_FRAME_LEN];
+            m_rx.peek(response, frameLen);
+            m_rx.consume(frameLen);
+            addResponse(time, m_rxStart, response, frameLen);
+            m_rxStart = time;
+        }
+    }
+
+    void addResponse(int64_t time, int64_t firstByteTime, const uint8_t *response, int len) {
+        while (m_pendingHead != m_pendingTail) {
+            SerialExchange &exchange = m_serial[m_pending[m_pendingHead++ % SERIAL_QUEUE_SIZE]];
+            int64_t delay = time - exchange.m_time;
+            if (delay > REPLAY_SERIAL_TIMEOUT_MS * NS_PER_MS) continue;
+
+            memcpy(exchange.m_response, response, len);
+            exchange.m_responseLen = len;
+            exchange.m_responseDelay = delay;
+            exchange.m_firstByteDelay = firstByteTime - exchange.m_time;
+            return;
+        }
+    }
+
+    bool addPmc8Command(const RecordHeader &header, const uint8_t *command) {
+        if (header.m_session >= PMC8_MAX_SESSIONS || header.m_length > PMC8_MAX_COMMAND_LEN) return true;
+
+        Pmc8Exchange *exchange = m_pmc8.add();
+        if (exchange == NULL) return false;
+
+        exchange->m_time = header.m_time;
+        exchange->m_session = header.m_session;
+        memcpy(exchange->m_command, command, header.m_length);
+        exchange->m_commandLen = header.m_length;
+        m_pendingPmc8[header.m_session] = m_pmc8.count() - 1;
+        return true;
+    }
+
+    void addPmc8Response(const RecordHeader &header, const uint8_t *response) {
+        if (header.m_session >= PMC8_MAX_SESSIONS || m_pendingPmc8[header.m_session] == -1) return;
+
+        Pmc8Exchange &exchange = m_pmc8[m_pendingPmc8[header.m_session]];
+        m_pendingPmc8[header.m_session] = -1;
+
+        int len = header.m_length < PMC8_MAX_COMMAND_LEN ? header.m_length : PMC8_MAX_COMMAND_LEN;
+        memcpy(exchange.m_response, response, len);
+        exchange.m_responseLen = len;
+    }
+};
+
+/*
+ * Maps replay time to recording time. At speed 0 commands are sent as fast as the bridge answers them and the
+ * recording time only advances from one command to the next.
+ */
+class ReplayClock {
+    double m_speed;
+    int64_t m_recordingStart;
+    int64_t m_replayStart;  // 0 until started
+    int64_t m_current;      // Speed 0: recording time of the last command sent
+
+public:
+    ReplayClock(double speed, int64_t recordingStart): m_speed(speed), m_recordingStart(recordingStart),
+            m_replayStart(0), m_current(recordingStart) {
+    }
+
+    void start() {
+        __atomic_store_n(&m_replayStart, monotonicNs(), __ATOMIC_RELEASE);
+    }
+
+    double speed() const {
+        return m_speed;
+    }
+
+    /* Any thread */
+    int64_t recordingTime() const {
+        return recordingTime(monotonicNs());
+    }
+
+    /* Recording time at the given CLOCK_MONOTONIC replay time */
+    int64_t recordingTime(int64_t replayTime) const {
+        if (m_speed == 0) return __atomic_load_n(&m_current, __ATOMIC_ACQUIRE);
+
+        int64_t replayStart = __atomic_load_n(&m_replayStart, __ATOMIC_ACQUIRE);
+        if (replayStart == 0) return m_recordingStart;
+        return m_recordingStart + (int64_t) ((replayTime - replayStart) * m_speed);
+    }
+
+    /* Replay time at which something recorded at the given time is due, speed must not be 0 */
+    int64_t replayTime(int64_t recordingTime) const {
+        return m_replayStart + (int64_t) ((recordingTime - m_recordingStart) / m_speed);
+    }
+
+    void advance(int64_t recordingTime) {
+        __atomic_store_n(&m_current, recordingTime, __ATOMIC_RELEASE);
+    }
+
+    /* Seconds into the recording, for reports */
+    double offset(int64_t recordingTime) const {
+        return (recordingTime - m_recordingStart) * 1e-9;
+    }
+};
+
+/*
+ * Stands in for the motor controllers behind a pseudo terminal. A frame from the bridge is answered with the
+ * response the mount gave to the same frame last before the current recording time, so inquiries return the
+ * recorded positions. Frames that weren't recorded get the response to the same opcode on the same axis.
+ * Slew, goto and enable frames are matched against the recorded ones to find where the bridge diverges.
+ */
+class MountReplayer {
+    const ReplaySession &m_session;
+    const ReplayClock &m_clock;
+    bool *m_matched; // Recorded motion frame reproduced by the replay
+    FileDescriptor m_master;
+    FileDescriptor m_slave;
+    RingBuffer<256> m_input;
+    pthread_t m_thread;
+    int m_threadCreateStatus;
+    bool m_stopRequested;
+    unsigned m_numFrames;
+    unsigned m_numUnmatched;
+    unsigned m_numUnanswered;
+    unsigned m_numExtraMotion;
+    unsigned m_numMissingMotion;
+    DivergenceLog m_divergences;
+
+public:
+    MountReplayer(const ReplaySession &session, const ReplayClock &clock): m_session(session), m_clock(clock),
+            m_matched(NULL), m_threadCreateStatus(-1), m_stopRequested(false), m_numFrames(0), m_numUnmatched(0),
+            m_numUnanswered(0), m_numExtraMotion(0), m_numMissingMotion(0) {
+    }
+
+    ~MountReplayer() {
+        stop();
+        free(m_matched);
+    }
+
+    /* Returns path of the pseudo terminal for the bridge to open */
+    const char *start() {
+        m_matched = (bool *) calloc(m_session.serial().count() + 1, sizeof(bool));
+        if (m_matched == NULL) return NULL;
+
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master == -1) return NULL;
+        m_master.set(master);
+
+        if (grantpt(master) == -1 || unlockpt(master) == -1) return NULL;
+
+        const char *slavePath = ptsname(master);
+        if (slavePath == NULL) return NULL;
+
+        int slave = ::open(slavePath, O_RDWR | O_NOCTTY);
+        if (slave == -1) return NULL;
+        m_slave.set(slave);
+
+        termios params;
+        if (tcgetattr(slave, &params) == -1) return NULL;
+        cfmakeraw(&params);
+        if (tcsetattr(slave, TCSANOW, &params) == -1) return NULL;
+
+        m_threadCreateStatus = pthread_create(&m_thread, NULL, threadProc, this);
+        return m_threadCreateStatus == 0 ? slavePath : NULL;
+    }
+
+    void stop() {
+        if (m_threadCreateStatus == 0) {
+            __atomic_store_n(&m_stopRequested, true, __ATOMIC_RELEASE);
+            pthread_join(m_thread, NULL);
+            m_threadCreateStatus = -1;
+        }
+    }
+
+    /* After stop, counts recorded motion frames between the given recording times the bridge didn't send */
+    void findMissingMotion(int64_t from, int64_t to) {
+        const RecordArray<SerialExchange> &serial = m_session.serial();
+
+        for (unsigned i = 0; i < serial.count(); i++) {
+            const SerialExchange &exchange = serial[i];
+            if (exchange.m_time < from || exchange.m_time > to || m_matched[i]) continue;
+            if (!isMotionFrame(exchange.m_cmd, exchange.m_cmdLen)) continue;
+
+            m_numMissingMotion++;
+            logFrame("missing frame", m_clock.offset(exchange.m_time), exchange.m_cmd, exchange.m_cmdLen);
+        }
+    }
+
+    unsigned numFrames() const {
+        return m_numFrames;
+    }
+
+    unsigned numUnmatched() const {
+        return m_numUnmatched;
+    }
+
+    unsigned numUnanswered() const {
+        return m_numUnanswered;
+    }
+
+    unsigned numExtraMotion() const {
+        return m_numExtraMotion;
+    }
+
+    unsigned numMissingMotion() const {
+        return m_numMissingMotion;
+    }
+
+    const DivergenceLog& divergences() const {
+        return m_divergences;
+    }
+
+private:
+    static void *threadProc(void *arg) {
+        ((MountReplayer *) arg)->run();
+        return NULL;
+    }
+
+    void run() {
+        pollfd pfd = { m_master, POLLIN, 0 };
+
+        while (!__atomic_load_n(&m_stopRequested, __ATOMIC_ACQUIRE)) {
+            int result = poll(&pfd, 1, REPLAY_POLL_INTERVAL_MS);
+
+            if (result == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "poll failed: %d\n", errno);
+                break;
+            }
+
+            int64_t received = monotonicNs();
+
+            if (result == 1 && (pfd.revents & POLLIN)) {
+                if (m_input.readFrom(m_master) <= 0 && errno != EAGAIN && errno != EIO) {
+                    fprintf(stderr, "Read failed: %d\n", errno);
+                    break;
+                }
+            }
+
+            processInput(received);
+        }
+    }
+
+    /* Frames read together were written together, recorded turnarounds of a batch all count from its write */
+    void processInput(int64_t received) {
+        while (m_input.size() >= 4) {
+            if (m_input[0] != 0x55 || m_input[1] != 0xaa || m_input[2] != 0x01) {
+                m_input.consume(1);
+                continue;
+            }
+
+            unsigned frameLen = m_input[3] + 4;
+
+            if (frameLen > SERIAL_MAX_FRAME_LEN) {
+                m_input.consume(1);
+                continue;
+            }
+
+            if (m_input.size() < frameLen) break;
+
+            uint8_t frame[SERIAL_MAX_FRAME_LEN];
+            m_input.peek(frame, frameLen);
+            m_input.consume(frameLen);
+            m_numFrames++;
+            processFrame(frame, frameLen, received);
+        }
+    }
+
+    void processFrame(const uint8_t *frame, int len, int64_t received) {
+        int64_t now = m_clock.recordingTime(received);
+        bool expectResponse = getFrameOp(frame, len) != SERIAL_OP_ENABLE;
+
+        if (isMotionFrame(frame, len)) matchMotionFrame(frame, len, now);
+        if (!expectResponse) return;
+
+        int index = findExchange(now, [&](const SerialExchange &exchange) {
+            return exchange.m_responseLen != 0 && isSameFrame(exchange, frame, len);
+        });
+
+        if (index == -1) {
+            // Bridge asks something it didn't ask during the recording, answer like the mount did to the opcode
+            index = findExchange(now, [&](const SerialExchange &exchange) {
+                return exchange.m_responseLen != 0 && exchange.m_cmdLen == len && exchange.m_cmd[4] == frame[4];
+            });
+
+            if (index == -1) {
+                m_numUnanswered++;
+                logFrame("unanswered frame", m_clock.offset(now), frame, len);
+                return;
+            }
+
+            m_numUnmatched++;
+        }
+
+        const SerialExchange &exchange = m_session.serial()[index];
+        uint8_t response[SERIAL_MAX_FRAME_LEN];
+        memcpy(response, exchange.m_response, exchange.m_responseLen);
+
+        if (getFrameOp(frame, len) == SERIAL_OP_INQUIRY) interpolatePosition(index, now, response);
+
+        if (m_clock.speed() > 0) {
+            // Answer with the recorded turnaround
+            int64_t due = received + (int64_t) (exchange.m_responseDelay / m_clock.speed());
+            timespec deadline = { (time_t) (due / NS_PER_SEC), (long) (due % NS_PER_SEC) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+        }
+
+        if (!m_master.writeFully(response, exchange.m_responseLen)) {
+            fprintf(stderr, "Write failed: %d\n", errno);
+        }
+    }
+
+    /*
+     * Inquiries are sampled far apart compared to how fast a goto moves, so the count is interpolated between the
+     * recorded samples around now. Status changes in between are left alone, the axis started or stopped there.
+     */
+    void interpolatePosition(int index, int64_t now, uint8_t *response) {
+        const RecordArray<SerialExchange> &serial = m_session.serial();
+        const SerialExchange &before = serial[index];
+        if (before.m_responseLen != 9 || before.m_time > now) return;
+
+        unsigned next = index + 1;
+        while (next < serial.count() && !(serial[next].m_responseLen != 0
+                && isSameFrame(serial[next], before.m_cmd, before.m_cmdLen))) next++;
+        if (next == serial.count()) return;
+
+        const SerialExchange &after = serial[next];
+        if (after.m_responseLen != 9 || after.m_response[5] != before.m_response[5]) return;
+
+        // Bridge takes the count as latched halfway between writing the frame and the first response byte. The
+        // replayed response arrives in one piece after the recorded round trip.
+        int64_t beforeTime = before.m_time + before.m_firstByteDelay / 2;
+        int64_t afterTime = after.m_time + after.m_firstByteDelay / 2;
+        if (afterTime <= beforeTime) return;
+
+        int64_t sampleTime = now + before.m_responseDelay / 2;
+        int beforeCount = readCount(before.m_response);
+        int afterCount = readCount(after.m_response);
+        double fraction = (sampleTime - beforeTime) / (double) (afterTime - beforeTime);
+        if (fraction < 0) fraction = 0;
+        if (fraction > 1) fraction = 1;
+
+        int count = lround(beforeCount + (afterCount - beforeCount) * fraction);
+        response[6] = count >> 16;
+        response[7] = count >> 8;
+        response[8] = count;
+    }
+
+    static int readCount(const uint8_t *response) {
+        int count = (int8_t) response[6];
+        count = (count << 8) | response[7];
+        return (count << 8) | response[8];
+    }
+
+    /* Marks the closest unmatched recorded frame within the tolerance as reproduced */
+    void matchMotionFrame(const uint8_t *frame, int len, int64_t now) {
+        const RecordArray<SerialExchange> &serial = m_session.serial();
+        int64_t tolerance = REPLAY_MOTION_TOLERANCE_MS * NS_PER_MS;
+        int best = -1;
+
+        for (int i = lastAtOrBefore(now + tolerance); i >= 0 && serial[i].m_time >= now - tolerance; i--) {
+            if (m_matched[i] || !isSameMotion(serial[i], frame, len)) continue;
+            if (best == -1 || llabs(serial[i].m_time - now) < llabs(serial[best].m_time - now)) best = i;
+        }
+
+        if (best != -1) {
+            m_matched[best] = true;
+        } else {
+            m_numExtraMotion++;
+            logFrame("extra frame", m_clock.offset(now), frame, len);
+        }
+    }
+
+    /* Latest exchange at or before the time the predicate accepts, otherwise the earliest after it, or -1 */
+    template <typename F>
+    int findExchange(int64_t time, F accept) const {
+        const RecordArray<SerialExchange> &serial = m_session.serial();
+        int start = lastAtOrBefore(time);
+
+        for (int i = start; i >= 0; i--) {
+            if (accept(serial[i])) return i;
+        }
+
+        for (unsigned i = start + 1; i < serial.count(); i++) {
+            if (accept(serial[i])) return i;
+        }
+
+        return -1;
+    }
+
+    /* Index of the last exchange written at or before the time, -1 if none */
+    int lastAtOrBefore(int64_t time) const {
+        const RecordArray<SerialExchange> &serial = m_session.serial();
+        int low = 0;
+        int high = serial.count();
+
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (serial[mid].m_time <= time) low = mid + 1; else high = mid;
+        }
+
+        return low - 1;
+    }
+
+    static bool isSameFrame(const SerialExchange &exchange, const uint8_t *frame, int len) {
+        return exchange.m_cmdLen == len && memcmp(exchange.m_cmd, frame, len) == 0;
+    }
+
+    /* Gotos to the same target match if their rates are close enough */
+    static bool isSameMotion(const SerialExchange &exchange, const uint8_t *frame, int len) {
+        if (getFrameOp(frame, len) != SERIAL_OP_GOTO || len != 10) return isSameFrame(exchange, frame, len);
+        if (exchange.m_cmdLen != len || exchange.m_cmd[4] != frame[4]) return false;
+        if (memcmp(exchange.m_cmd + 7, frame + 7, 3) != 0) return false; // Target
+
+        int recordedRate = exchange.m_cmd[5] << 8 | exchange.m_cmd[6];
+        int rate = frame[5] << 8 | frame[6];
+        return abs(rate - recordedRate) * 100 <= recordedRate * REPLAY_RATE_TOLERANCE_PERCENT;
+    }
+
+    void logFrame(const char *what, double offset, const uint8_t *frame, int len) {
+        char hex[SERIAL_MAX_FRAME_LEN * 3 + 1];
+
+        for (int i = 0; i < len; i++) {
+            snprintf(hex + i * 3, 4, "%02X ", frame[i]);
+        }
+
+        m_divergences.add("%10.3f s  serial  %s %.*s", offset, what, len * 3 - 1, hex);
+    }
+};
+
+/*
+ * Sends the recorded PMC8 commands to the server, on one connection per recorded session, and compares the
+ * responses with the recorded ones. ESGp responses may differ by the position tolerance and ESGr responses by
+ * REPLAY_RATE_TOLERANCE_PERCENT, everything else must match exactly.
+ */
+class Pmc8Replayer {
+    const ReplaySession &m_session;
+    ReplayClock &m_clock;
+    int m_port;
+    int m_positionTolerance;
+    FileDescriptor m_sockets[PMC8_MAX_SESSIONS];
+    RingBuffer<PMC8_INPUT_BUFFER_SIZE> m_input[PMC8_MAX_SESSIONS];
+    Histogram m_latencies[PMC8_CMD_COUNT];
+    Histogram m_totalLatency;
+    unsigned m_diverged[PMC8_CMD_COUNT];
+    unsigned m_failures[PMC8_CMD_COUNT];
+    int m_maxPositionError;
+    DivergenceLog m_divergences;
+
+public:
+    Pmc8Replayer(const ReplaySession &session, ReplayClock &clock, int port, int positionTolerance):
+            m_session(session), m_clock(clock), m_port(port), m_positionTolerance(positionTolerance), m_diverged(),
+            m_failures(), m_maxPositionError(0) {
+    }
+
+    /* Returns false if it cannot talk to the server */
+    bool run() {
+        const RecordArray<Pmc8Exchange> &pmc8 = m_session.pmc8();
+
+        for (unsigned i = 0; i < pmc8.count(); i++) {
+            const Pmc8Exchange &exchange = pmc8[i];
+
+            if (m_clock.speed() > 0) {
+                int64_t due = m_clock.replayTime(exchange.m_time);
+                timespec deadline = { (time_t) (due / NS_PER_SEC), (long) (due % NS_PER_SEC) };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+            } else {
+                m_clock.advance(exchange.m_time);
+            }
+
+            if (!replay(exchange)) return false;
+        }
+
+        return true;
+    }
+
+    const Histogram& latency(int command) const {
+        return m_latencies[command];
+    }
+
+    const Histogram& totalLatency() const {
+        return m_totalLatency;
+    }
+
+    unsigned diverged(int command) const {
+        return m_diverged[command];
+    }
+
+    unsigned failures(int command) const {
+        return m_failures[command];
+    }
+
+    int maxPositionError() const {
+        return m_maxPositionError;
+    }
+
+    const DivergenceLog& divergences() const {
+        return m_divergences;
+    }
+
+private:
+    bool replay(const Pmc8Exchange &exchange) {
+        FileDescriptor &socket = m_sockets[exchange.m_session];
+        if (socket == -1 && !connectSession(socket)) return false;
+
+        Pmc8Command command = Pmc8Server::classifyCommand(exchange.m_command, exchange.m_commandLen);
+        double offset = m_clock.offset(exchange.m_time);
+        int64_t sent = monotonicNs();
+
+        if (!socket.writeFully(exchange.m_command, exchange.m_commandLen)) {
+            fprintf(stderr, "PMC8 write failed: %d\n", errno);
+            return false;
+        }
+
+        if (exchange.m_responseLen == 0) return true; // Nothing to wait for
+
+        char response[PMC8_MAX_COMMAND_LEN];
+        int responseLen = readResponse(exchange.m_session, response, sizeof(response));
+        int64_t received = monotonicNs();
+
+        if (responseLen < 0) {
+            m_failures[command]++;
+            m_divergences.add("%10.3f s  pmc8    %.*s no response, recorded %.*s", offset, exchange.m_commandLen,
+                    exchange.m_command, exchange.m_responseLen, exchange.m_response);
+            return true;
+        }
+
+        m_latencies[command].recordNs(received - sent);
+        m_totalLatency.recordNs(received - sent);
+
+        if (!isSameResponse(command, exchange, response, responseLen)) {
+            m_diverged[command]++;
+            m_divergences.add("%10.3f s  pmc8    %.*s responded %.*s, recorded %.*s", offset, exchange.m_commandLen,
+                    exchange.m_command, responseLen, response, exchange.m_responseLen, exchange.m_response);
+        }
+
+        return true;
+    }
+
+    bool isSameResponse(Pmc8Command command, const Pmc8Exchange &exchange, const char *response, int len) {
+        if (len == exchange.m_responseLen && memcmp(response, exchange.m_response, len) == 0) return true;
+        if (command != PMC8_CMD_GP && command != PMC8_CMD_GR) return false;
+        if (len < 7 || exchange.m_responseLen < 7 || memcmp(response, exchange.m_response, 5) != 0) return false;
+
+        int replayed = strtol(response + 5, NULL, 16);
+        int recorded = strtol(exchange.m_response + 5, NULL, 16);
+
+        if (command == PMC8_CMD_GR) {
+            return abs(replayed - recorded) * 100 <= recorded * REPLAY_RATE_TOLERANCE_PERCENT;
+        }
+
+        // Positions are 24 bit counts, compare them modulo 2^24
+        int error = ((int32_t) ((replayed - recorded) << 8)) >> 8;
+        if (error < 0) error = -error;
+
+        if (error > m_maxPositionError) m_maxPositionError = error;
+        return error <= m_positionTolerance;
+    }
+
+    bool connectSession(FileDescriptor &socket) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd == -1) {
+            fprintf(stderr, "Cannot create socket: %d\n", errno);
+            return false;
+        }
+
+        socket.set(fd);
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+            fprintf(stderr, "Cannot connect to port %d: %d\n", m_port, errno);
+            return false;
+        }
+
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        return true;
+    }
+
+    /* Reads one '!' terminated response, returns its length or -1 */
+    int readResponse(int session, char *response, int len) {
+        RingBuffer<PMC8_INPUT_BUFFER_SIZE> &input = m_input[session];
+        int64_t deadline = monotonicNs() + REPLAY_RESPONSE_TIMEOUT_MS * NS_PER_MS;
+
+        while (true) {
+            int end = input.find('!');
+
+            if (end != -1) {
+                int responseLen = end + 1 < len ? end + 1 : len;
+                input.peek(response, responseLen);
+                input.consume(end + 1);
+                return responseLen;
+            }
+
+            if (input.space() == 0) input.clear(); // Garbage, drop it
+
+            int64_t timeout = deadline - monotonicNs();
+            pollfd pfd = { m_sockets[session], POLLIN, 0 };
+            if (timeout <= 0 || poll(&pfd, 1, (timeout + NS_PER_MS - 1) / NS_PER_MS) != 1) return -1;
+            if (input.readFrom(m_sockets[session]) <= 0) return -1;
+        }
+    }
+};